@@ -0,0 +1,592 @@
+#pragma once
+#include "cpk.hpp"
+#include "mpk.hpp"
+#include "io.hpp"
+#include "worker_pool.hpp"
+#include "pipeline.hpp"
+#include "tar.hpp"
+#include "hash.hpp"
+#include <unordered_set>
+// Format agnostic view of CPK/MPK archives, so that both tools can
+// process any mix of them in a single invocation
+namespace archive {
+	enum class format { UNKNOWN, CPK, MPK };
+
+	inline format detect(std::filesystem::path const& path) {
+		FILE* fp = fopen(path.string().c_str(), "rb");
+		if (!fp) return format::UNKNOWN;
+		uint32_t magic = 0;
+		fread(&magic, sizeof(magic), 1, fp);
+		fclose(fp);
+		switch (magic) {
+		case cpk::CPK_MAGIC: return format::CPK;
+		case mpk::MPK_MAGIC: return format::MPK;
+		default: return format::UNKNOWN;
+		}
+	}
+
+	struct entry {
+		uint32_t id{};
+		uint64_t offset{};
+		uint64_t size{};
+		uint64_t size_decompressed{};
+		bool compressed{}; // CRILAYLA. MPK compression is ignored for now.
+		std::string name; // Unpacked file name. See the respective tools' notes.
+	};
+	typedef std::vector<entry> entries;
+
+	struct index {
+		std::filesystem::path path;
+		format type{ format::UNKNOWN };
+		archive::entries entries;
+	};
+
+	// Sidecar index (<archive>.mgi), letting unchanged archives be reopened without parsing their TOC.
+	// Little-endian, fixed layout: a `header`, `count` records, then the names they point into.
+	// It's only trusted if the archive's size, mtime and leading bytes still match what it was written for.
+	namespace sidecar {
+		constexpr uint32_t MAGIC = fourCC('M', 'G', 'I', '\0');
+		constexpr uint32_t VERSION = 1;
+		constexpr size_t HASHED_BYTES = 4096; // Covers the CPK header table and the MPK header
+		struct header {
+			uint32_t magic, version;
+			uint64_t archive_size;
+			int64_t archive_mtime;
+			uint64_t archive_hash;
+			uint32_t type, count;
+			uint64_t names_size;
+		};
+		struct record {
+			uint32_t id;
+			uint32_t compressed;
+			uint64_t offset, size, size_decompressed;
+			uint32_t name_offset, name_size;
+		};
+
+		// Opt-in. See --index-cache
+		inline bool& enabled() {
+			static bool value = false;
+			return value;
+		}
+		inline std::filesystem::path path_of(std::filesystem::path const& archive) {
+			std::filesystem::path path = archive;
+			return path += ".mgi";
+		}
+		// Key of the archive's current state, in a header with the rest left blank. False if it can't be read.
+		inline bool key_of(std::filesystem::path const& archive, header& key) {
+			std::error_code ec;
+			key = { .magic = MAGIC, .version = VERSION };
+			key.archive_size = std::filesystem::file_size(archive, ec);
+			if (ec) return false;
+			key.archive_mtime = std::filesystem::last_write_time(archive, ec).time_since_epoch().count();
+			if (ec) return false;
+			io::file fin(archive);
+			uint8_t leading[HASHED_BYTES];
+			if (!fin) return false;
+			size_t size = fin.read_at(leading, std::min<uint64_t>(key.archive_size, sizeof(leading)), 0);
+			key.archive_hash = xxh64::hash(leading, size);
+			return true;
+		}
+		inline bool load(index& archive) {
+			trace::scope _("index cache read");
+			header key, hdr;
+			if (!key_of(archive.path, key)) return false;
+			io::file fin(path_of(archive.path));
+			if (!fin || fin.read_at(&hdr, sizeof(hdr), 0) != sizeof(hdr)) return false;
+			if (hdr.magic != key.magic || hdr.version != key.version || hdr.archive_size != key.archive_size || hdr.archive_mtime != key.archive_mtime || hdr.archive_hash != key.archive_hash)
+				return false;
+			std::error_code ec;
+			if (hdr.type != (uint32_t)format::CPK && hdr.type != (uint32_t)format::MPK) return false;
+			if (sizeof(hdr) + hdr.count * sizeof(record) + hdr.names_size != std::filesystem::file_size(path_of(archive.path), ec) || ec) return false;
+			u8vec body(hdr.count * sizeof(record) + hdr.names_size);
+			if (fin.read_at(body.data(), body.size(), sizeof(hdr)) != body.size()) return false;
+			auto records = (const record*)body.data();
+			auto names = (const char*)(records + hdr.count);
+			archive.type = (format)hdr.type;
+			archive.entries.resize(hdr.count);
+			for (size_t i = 0; i < hdr.count; i++) {
+				auto& rec = records[i];
+				if ((uint64_t)rec.name_offset + rec.name_size > hdr.names_size) return false;
+				archive.entries[i] = { rec.id, rec.offset, rec.size, rec.size_decompressed, rec.compressed != 0, std::string(names + rec.name_offset, rec.name_size) };
+			}
+			return true;
+		}
+		// Best effort. Archives in read-only locations simply go without.
+		inline void save(index const& archive) {
+			header hdr;
+			if (!key_of(archive.path, hdr)) return;
+			hdr.type = (uint32_t)archive.type, hdr.count = (uint32_t)archive.entries.size();
+			std::vector<record> records;
+			std::string names;
+			for (auto& entry : archive.entries) {
+				records.push_back({ entry.id, entry.compressed, entry.offset, entry.size, entry.size_decompressed, (uint32_t)names.size(), (uint32_t)entry.name.size() });
+				names += entry.name;
+			}
+			hdr.names_size = names.size();
+			std::filesystem::path path = path_of(archive.path), temp = path;
+			temp += ".tmp";
+			FILE* fp = fopen(temp.string().c_str(), "wb");
+			if (!fp) return;
+			fwrite(&hdr, sizeof(hdr), 1, fp);
+			fwrite(records.data(), sizeof(record), records.size(), fp);
+			fwrite(names.data(), 1, names.size(), fp);
+			bool failed = ferror(fp);
+			fclose(fp);
+			std::error_code ec;
+			if (!failed) std::filesystem::rename(temp, path, ec);
+			if (failed || ec) std::filesystem::remove(temp, ec);
+		}
+	}
+
+	inline index open(std::filesystem::path const& path) {
+		trace::scope _("open", "phase", path.filename().string());
+		if (sidecar::enabled()) {
+			index archive{ .path = path };
+			if (sidecar::load(archive)) return archive;
+		}
+		index archive{ .path = path, .type = detect(path) };
+		CHECK(archive.type != format::UNKNOWN, "Not a CPK/MPK archive: " + path.string());
+		FILE* fp = fopen(path.string().c_str(), "rb");
+		CHECK(fp, "Failed to open input file: " + path.string());
+		if (archive.type == format::MPK) {
+			mpk::mpk_header hdr;
+			std::vector<mpk::mpk_entry> entries;
+			{
+				trace::scope _("toc read");
+				fread(&hdr, sizeof(hdr), 1, fp);
+				entries.resize(hdr.entries);
+				fread(entries.data(), sizeof(mpk::mpk_entry), hdr.entries, fp);
+			}
+			for (auto& entry : entries)
+				archive.entries.push_back({ entry.entry_id, entry.offset, entry.size, entry.size_decompressed, false, entry.to_unpacked_filename() });
+		}
+		else {
+			package::packed_file_entries files = package::ITOC().unpack(fp);
+			// The unpacked files are named by their order in the ID sorted table
+			uint32_t id = 0;
+			for (auto& file : files)
+				archive.entries.push_back({ file.id, file.offset, file.size, file.size_decompressed, file.size != file.size_decompressed, std::to_string(id++) });
+		}
+		fclose(fp);
+		if (sidecar::enabled()) sidecar::save(archive);
+		return archive;
+	}
+
+	// Expands directories into the archives they contain. Files that aren't CPK/MPK archives
+	// are skipped when found in a directory, and rejected when specified explicitly.
+	inline std::vector<std::filesystem::path> collect_inputs(std::vector<std::string> const& inputs) {
+		using namespace std::filesystem;
+		std::vector<path> archives;
+		for (auto& input : inputs) {
+			CHECK(exists(input), "Input does not exist: " + input);
+			if (is_directory(input)) {
+				std::vector<path> found;
+				for (auto& file : directory_iterator(input))
+					if (file.is_regular_file() && detect(file.path()) != format::UNKNOWN)
+						found.push_back(file.path());
+				std::sort(found.begin(), found.end());
+				archives.insert(archives.end(), found.begin(), found.end());
+			}
+			else {
+				CHECK(detect(input) != format::UNKNOWN, "Not a CPK/MPK archive: " + input);
+				archives.push_back(input);
+			}
+		}
+		return archives;
+	}
+
+	// A file about to be repacked. Its contents are read from `path`, or produced by `source` when set.
+	struct repack_file {
+		uint32_t id;
+		uint64_t size;
+		std::string path;
+		std::function<void(uint8_t* dst)> source;
+	};
+	// Finds the files left unchanged from their counterpart (by ID) in `reference`, so that its stored bytes
+	// can be reused instead. Same sized candidates are compared in full, decompressed if need be, on `threads` workers.
+	// Returns the matching entry of each file, or nullptr.
+	inline std::vector<const entry*> unchanged_entries(index const& reference, std::vector<repack_file> const& files, size_t threads) {
+		std::unordered_map<uint32_t, const entry*> by_id;
+		for (auto& entry : reference.entries) by_id[entry.id] = &entry;
+		std::vector<const entry*> matches(files.size());
+		io::file fin(reference.path);
+		CHECK(fin, "Failed to open reference archive: " + reference.path.string());
+		{
+			worker_pool pool(threads);
+			for (size_t i = 0; i < files.size(); i++) {
+				auto it = by_id.find(files[i].id);
+				if (it == by_id.end() || it->second->size_decompressed != files[i].size) continue;
+				// MPK compression is ignored. Such entries would be stored differently anyway.
+				if (reference.type == format::MPK && it->second->size != it->second->size_decompressed) continue;
+				pool.submit([&, i, entry = it->second] {
+					trace::scope _("compare", "entry", entry->name);
+					thread_local u8vec contents, header, data;
+					auto& file = files[i];
+					contents.resize(file.size);
+					if (file.source) file.source(contents.data());
+					else {
+						io::file input(file.path);
+						if (!input || input.read_at(contents.data(), file.size, 0) != file.size) return;
+					}
+					u8stream stored(entry->size, false);
+					if (fin.read_at(stored.data(), entry->size, entry->offset) != entry->size) return;
+					if (entry->compressed) {
+						cpk::crilayla::decompress(stored, header, data);
+						if (header.size() + data.size() != file.size) return;
+						if (memcmp(contents.data(), header.data(), header.size()) || memcmp(contents.data() + header.size(), data.data(), data.size())) return;
+					}
+					else if (memcmp(contents.data(), stored.data(), file.size)) return;
+					matches[i] = entry;
+				});
+			}
+		}
+		uint64_t bytes = 0; size_t count = 0;
+		for (auto match : matches) if (match) bytes += match->size, count++;
+		fprintf(stderr, "%s: %zu of %zu files unchanged (%" PRIu64 " bytes reused)\n", reference.path.filename().string().c_str(), count, files.size(), bytes);
+		return matches;
+	}
+
+	// Reads an access trace (i.e. the order entries are loaded in game) into the IDs of `files`, first access first.
+	// One entry per line, either by ID (decimal, or hex with 0x) or by name: the unpacked file name, or for MPK
+	// entries the name after the 0x<id>_ prefix. Blank lines and lines starting with # are skipped.
+	inline std::vector<uint32_t> access_order(std::filesystem::path const& trace, std::vector<repack_file> const& files) {
+		std::unordered_map<std::string, uint32_t> by_name;
+		std::unordered_set<uint32_t> ids;
+		for (auto& file : files) {
+			std::string name = std::filesystem::path(file.path).filename().string();
+			by_name.insert({ name, file.id });
+			if (name.starts_with("0x") && name.find('_') != std::string::npos) by_name.insert({ name.substr(name.find('_') + 1), file.id });
+			ids.insert(file.id);
+		}
+		FILE* fin = fopen(trace.string().c_str(), "rb");
+		CHECK(fin, "Failed to open access trace: " + trace.string());
+		std::vector<uint32_t> order;
+		std::unordered_set<uint32_t> seen;
+		char buffer[4096];
+		size_t unknown = 0;
+		while (fgets(buffer, sizeof(buffer), fin)) {
+			std::string line = buffer;
+			while (line.size() && isspace((uint8_t)line.back())) line.pop_back();
+			if (line.empty() || line[0] == '#') continue;
+			std::optional<uint32_t> id;
+			char* end = nullptr;
+			unsigned long value = strtoul(line.c_str(), &end, 0);
+			if (*end == 0 && ids.contains((uint32_t)value)) id = (uint32_t)value;
+			else if (auto it = by_name.find(line); it != by_name.end()) id = it->second;
+			if (!id) { unknown++; continue; }
+			if (seen.insert(*id).second) order.push_back(*id);
+		}
+		fclose(fin);
+		if (unknown) fprintf(stderr, "%s: %zu unknown entries skipped\n", trace.filename().string().c_str(), unknown);
+		return order;
+	}
+
+	// Files identical to another one, and the contents read on the way
+	struct duplicates {
+		std::vector<size_t> of; // Index of the file each one duplicates, or SIZE_MAX
+		std::vector<u8vec> contents; // Contents of the (non duplicate) files read while hashing, as far as the budget allowed
+	};
+	// Finds the files identical to another one of `files`, so that they can share its stored copy.
+	// Same sized files are hashed on `threads` workers, and matching hashes are confirmed by a full comparison.
+	// Up to `retain_limit` bytes of what's read for hashing is kept, so that confirming (and later packing, see
+	// mpk::file_entry::contents) doesn't read those files again.
+	inline duplicates duplicate_files(std::vector<repack_file> const& files, size_t threads, size_t retain_limit = 0) {
+		auto read = [&](repack_file const& file, u8vec& contents) {
+			contents.resize(file.size);
+			if (file.source) { file.source(contents.data()); return true; }
+			io::file input(file.path);
+			return input && input.read_at(contents.data(), file.size, 0) == file.size;
+		};
+		std::unordered_map<uint64_t, std::vector<size_t>> by_size;
+		for (size_t i = 0; i < files.size(); i++)
+			if (files[i].size) by_size[files[i].size].push_back(i);
+		std::vector<uint64_t> hashes(files.size());
+		std::vector<uint8_t> hashed(files.size());
+		duplicates result{ std::vector<size_t>(files.size(), SIZE_MAX), std::vector<u8vec>(files.size()) };
+		std::atomic<size_t> retained = 0;
+		{
+			worker_pool pool(threads);
+			for (auto& [size, group] : by_size) {
+				if (group.size() < 2) continue;
+				for (size_t i : group)
+					pool.submit([&, i] {
+						trace::scope _("hash", "entry", files[i].path);
+						u8vec contents;
+						if (!read(files[i], contents)) return;
+						hashes[i] = xxh64::hash(contents.data(), contents.size()), hashed[i] = true;
+						if (retained.fetch_add(contents.size()) + contents.size() <= retain_limit) result.contents[i] = std::move(contents);
+						else retained -= contents.size();
+					});
+			}
+			pool.wait();
+			// Each file is confirmed against the first one found with the same size and hash
+			std::map<PAIR2(uint64_t), size_t> first;
+			for (size_t i = 0; i < files.size(); i++) {
+				if (!hashed[i]) continue;
+				auto [it, inserted] = first.insert({ { files[i].size, hashes[i] }, i });
+				if (inserted) continue;
+				pool.submit([&, i, original = it->second] {
+					trace::scope _("compare", "entry", files[i].path);
+					thread_local u8vec lhs, rhs;
+					auto& left = result.contents[original].size() ? result.contents[original] : lhs;
+					auto& right = result.contents[i].size() ? result.contents[i] : rhs;
+					if ((&left != &lhs || read(files[original], lhs)) && (&right != &rhs || read(files[i], rhs)) && !memcmp(left.data(), right.data(), left.size()))
+						result.of[i] = original;
+				});
+			}
+		}
+		// Duplicates aren't stored, so their contents aren't needed past the comparison
+		uint64_t bytes = 0; size_t count = 0;
+		for (size_t i = 0; i < files.size(); i++)
+			if (result.of[i] != SIZE_MAX) bytes += files[i].size, count++, result.contents[i] = {};
+		if (count) fprintf(stderr, "%zu duplicate files share their stored copy (%" PRIu64 " bytes saved)\n", count, bytes);
+		return result;
+	}
+
+	// Receives unpacked files from the pipeline's writer stage. `name` is relative, with
+	// the unpacked naming conventions applied.
+	struct sink {
+		virtual void write(std::filesystem::path const& name, entry const& entry, u8vec const& header, u8vec const& data) = 0;
+		// Entries for which this returns true are left out of the pipeline altogether
+		virtual bool completed(std::filesystem::path const&, entry const&) { return false; }
+		// Called once with the names of every file about to be written, before any is
+		virtual void prepare(std::vector<std::filesystem::path> const&) {}
+		virtual ~sink() = default;
+	};
+
+	// Append-only record of the files a directory_sink has finished, one line per file:
+	//   <entry id> <size> <xxh64 of contents> <name>
+	// Lines are flushed every FLUSH_INTERVAL files, so an interrupted run redoes at most that many
+	// files on top of the ones it didn't get to. A torn last line is cut off before appending again, and
+	// malformed lines are skipped, so the files they were for are redone.
+	struct journal {
+		static constexpr const char* FILENAME = ".unpack-journal";
+		static constexpr size_t FLUSH_INTERVAL = 64;
+		struct record {
+			uint32_t id;
+			uint64_t size, hash;
+		};
+		std::filesystem::path path;
+		std::unordered_map<std::string, record> records;
+		std::string last; // Name of the last recorded file
+		FILE* fp{ nullptr };
+		size_t unflushed{ 0 };
+
+		journal(std::filesystem::path const& root) : path(root / FILENAME) {}
+		~journal() { if (fp) fclose(fp); }
+		// Returns the length of the journal up to its last complete line
+		uint64_t load() {
+			FILE* fin = fopen(path.string().c_str(), "rb");
+			if (!fin) return 0;
+			std::string contents;
+			char chunk[4096];
+			while (size_t count = fread(chunk, 1, sizeof(chunk), fin)) contents.append(chunk, count);
+			fclose(fin);
+			size_t begin = 0;
+			for (size_t end; (end = contents.find('\n', begin)) != std::string::npos; begin = end + 1) {
+				std::string line = contents.substr(begin, end - begin);
+				record rec; int name_at = 0;
+				if (sscanf(line.c_str(), "%u %" SCNu64 " %" SCNx64 " %n", &rec.id, &rec.size, &rec.hash, &name_at) != 3 || !name_at || !line[name_at]) continue;
+				records[last = line.substr(name_at)] = rec;
+			}
+			return begin;
+		}
+		// Starts a fresh journal, or continues the existing one when resuming
+		void open(bool resume) {
+			if (resume) {
+				std::error_code ec;
+				uint64_t length = load();
+				if (std::filesystem::exists(path, ec)) std::filesystem::resize_file(path, length, ec);
+				CHECK(!ec, "Failed to truncate journal: " + path.string());
+			}
+			fp = fopen(path.string().c_str(), resume ? "ab" : "wb");
+			CHECK(fp, "Failed to open journal: " + path.string());
+		}
+		void append(std::string const& name, record const& rec) {
+			fprintf(fp, "%u %" PRIu64 " %016" PRIx64 " %s\n", rec.id, rec.size, rec.hash, name.c_str());
+			if (++unflushed == FLUSH_INTERVAL) fflush(fp), unflushed = 0;
+		}
+		void remove() {
+			if (fp) fclose(fp), fp = nullptr;
+			std::error_code ec;
+			std::filesystem::remove(path, ec);
+		}
+	};
+
+	// Materializes files under a directory. Every finished file is journaled, so that an
+	// interrupted unpack can be resumed with only the remaining entries redone.
+	// The output tree is created upfront (see prepare), and files are then created relative to their
+	// directory's handle and written with a single call, keeping it to three syscalls per small file.
+	struct directory_sink : public sink {
+		std::filesystem::path root;
+		archive::journal journal;
+		std::unordered_map<std::string, std::unique_ptr<io::directory>> directories; // By path relative to `root`
+		static constexpr size_t PREALLOCATE_THRESHOLD = 1 << 20;
+		directory_sink(std::filesystem::path const& root, bool resume = false) : root(root), journal(root) {
+			std::filesystem::create_directories(root);
+			journal.open(resume);
+		}
+		// Journaled files are trusted if their size still matches, without reading them back: a file changed
+		// since at the same size isn't noticed. The last one is also re-hashed, as it's the one most likely
+		// to have been cut short.
+		virtual bool completed(std::filesystem::path const& name, entry const& entry) {
+			std::string key = name.generic_string();
+			auto it = journal.records.find(key);
+			if (it == journal.records.end()) return false;
+			auto& rec = it->second;
+			std::error_code ec;
+			if (rec.id != entry.id || rec.size != entry.size_decompressed || std::filesystem::file_size(root / name, ec) != rec.size || ec) return false;
+			if (key == journal.last) {
+				io::file fin(root / name);
+				u8vec buffer(rec.size);
+				if (!fin || fin.read_at(buffer.data(), buffer.size(), 0) != buffer.size()) return false;
+				return xxh64::hash(buffer.data(), buffer.size()) == rec.hash;
+			}
+			return true;
+		}
+		virtual void prepare(std::vector<std::filesystem::path> const& names) {
+			for (auto& name : names) {
+				std::string parent = name.parent_path().generic_string();
+				if (directories.contains(parent)) continue;
+				std::filesystem::create_directories(root / parent);
+				directories[parent].reset(new io::directory(root / parent));
+			}
+		}
+		virtual void write(std::filesystem::path const& name, entry const& entry, u8vec const& header, u8vec const& data) {
+			using namespace std::filesystem;
+			io::file fout;
+			auto it = directories.find(name.parent_path().generic_string());
+			if (it != directories.end()) fout.open(*it->second, name.filename(), true);
+			else {
+				path output = root / name;
+				if (output.has_parent_path() && !exists(output.parent_path()))
+					create_directories(output.parent_path());
+				fout.open(output, true);
+			}
+			CHECK(fout, "Failed to open output file: " + (root / name).string());
+			// Only worth the extra call for files spanning many extents
+			if (header.size() + data.size() >= PREALLOCATE_THRESHOLD) fout.preallocate(header.size() + data.size());
+			CHECK(fout.write_at(header, data, 0) == header.size() + data.size(), "Failed to write output file: " + (root / name).string());
+			fout.close();
+			xxh64 state;
+			state.update(header.data(), header.size());
+			state.update(data.data(), data.size());
+			journal.append(name.generic_string(), { entry.id, header.size() + data.size(), state.digest() });
+		}
+		// The journal is only kept around for interrupted runs
+		void finish() { journal.remove(); }
+	};
+	// Streams files into a tar archive
+	struct tar_sink : public sink {
+		tar::writer writer;
+		tar_sink(FILE* fp) : writer(fp) {}
+		virtual void write(std::filesystem::path const& name, entry const&, u8vec const& header, u8vec const& data) {
+			writer.begin(name.generic_string(), header.size() + data.size());
+			writer.write(header.data(), header.size());
+			writer.write(data.data(), data.size());
+		}
+		void finish() { writer.finish(); }
+	};
+
+	// Unpacks archives through a reader -> decoder -> writer pipeline.
+	// - A single reader issues archive reads in offset order. See io::read_schedule
+	// - `threads` decoders run CRILAYLA (or pass the data through)
+	// - A single writer hands the files to `output`. Each archive's files are prefixed with `prefixes[i]`
+	// Buffers in flight between the stages never exceed `mem_limit` bytes in total.
+	inline void unpack(std::vector<index> const& archives, std::vector<std::filesystem::path> const& prefixes, sink& output, size_t threads, size_t mem_limit) {
+		using namespace std::filesystem;
+		struct job {
+			const archive::entry* entry;
+			path name;
+			u8vec header, data;
+			size_t reserved;
+		};
+		threads = std::max<size_t>(threads, 1);
+		{
+			std::vector<path> names;
+			for (size_t i = 0; i < archives.size(); i++)
+				for (auto& entry : archives[i].entries) names.push_back(prefixes[i] / entry.name);
+			output.prepare(names);
+		}
+		pipeline::memory_budget budget(mem_limit);
+		pipeline::bounded_queue<job*> decode_queue(threads * 4), write_queue(threads * 4);
+
+		std::thread reader([&] {
+			trace::set_thread_name("reader");
+			for (size_t i = 0; i < archives.size(); i++) {
+				io::file fin(archives[i].path);
+				CHECK(fin, "Failed to open input file: " + archives[i].path.string());
+				std::vector<const entry*> pending;
+				std::vector<io::range> ranges;
+				for (auto& entry : archives[i].entries)
+					if (!output.completed(prefixes[i] / entry.name, entry))
+						pending.push_back(&entry), ranges.push_back({ entry.offset, entry.size });
+				if (pending.size() != archives[i].entries.size())
+					fprintf(stderr, "%s: resuming, %zu of %zu entries already unpacked\n", archives[i].path.filename().string().c_str(), archives[i].entries.size() - pending.size(), archives[i].entries.size());
+				io::read_schedule schedule(fin, ranges);
+				for (size_t j = 0; j < schedule.size(); j++) {
+					const entry* entry = pending[schedule.index(j)];
+					// Decoded data is accounted for upfront, so decoders never wait on the budget
+					size_t reserved = entry->size + (entry->compressed ? entry->size_decompressed : 0);
+					budget.acquire(reserved);
+					job* work = new job{ entry, prefixes[i] / entry->name, {}, u8vec(entry->size), reserved };
+					trace::scope _("read", "entry", entry->name);
+					CHECK(schedule.read(j, work->data.data()) == entry->size, "Truncated archive");
+					decode_queue.push(work);
+				}
+			}
+			for (size_t i = 0; i < threads; i++) decode_queue.push(nullptr);
+		});
+		std::atomic<size_t> decoders_left = threads;
+		std::vector<std::thread> decoders;
+		for (size_t i = 0; i < threads; i++)
+			decoders.emplace_back([&] {
+				trace::set_thread_name("decoder");
+				while (job* work = decode_queue.pop()) {
+					if (work->entry->compressed) {
+						trace::scope _("decompress", "entry", work->entry->name);
+						u8stream stream(std::move(work->data), false);
+						cpk::crilayla::decompress(stream, work->header, work->data);
+						budget.release(work->entry->size), work->reserved -= work->entry->size;
+					}
+					write_queue.push(work);
+				}
+				if (--decoders_left == 0) write_queue.push(nullptr);
+			});
+		trace::set_thread_name("writer");
+		while (job* work = write_queue.pop()) {
+			trace::scope _("write", "entry", work->entry->name);
+			output.write(work->name, *work->entry, work->header, work->data);
+			budget.release(work->reserved);
+			delete work;
+		}
+		reader.join();
+		for (auto& decoder : decoders) decoder.join();
+	}
+
+	// Unpacks every archive in `inputs`. The TOCs are parsed in parallel, and entries
+	// from all archives then share a single pipeline.
+	// A lone archive is unpacked as is. Otherwise, each archive's files are put under
+	// its own `<archive name>` subdirectory (without the extension, unless another input shares the stem).
+	inline void unpack(std::vector<std::string> const& inputs, sink& output, size_t threads, size_t mem_limit) {
+		using namespace std::filesystem;
+		std::vector<path> paths = collect_inputs(inputs);
+		CHECK(paths.size(), "No CPK/MPK archives found in input");
+		std::vector<index> archives(paths.size());
+		{
+			worker_pool pool(threads);
+			for (size_t i = 0; i < paths.size(); i++)
+				pool.submit([&, i] { archives[i] = open(paths[i]); });
+		}
+		// Archives sharing a stem (i.e. x.cpk and x.mpk) keep their extension. Ones sharing a file name
+		// (from different directories) would overwrite each other's files.
+		std::map<path, size_t> stems, names;
+		for (auto& archive : archives) stems[archive.path.stem()]++, names[archive.path.filename()]++;
+		std::vector<path> prefixes;
+		for (auto& archive : archives) {
+			CHECK(names[archive.path.filename()] == 1, "Several input archives are named " + archive.path.filename().string() + ", their files would overwrite each other");
+			prefixes.push_back(archives.size() == 1 ? path() : stems[archive.path.stem()] == 1 ? archive.path.stem() : archive.path.filename());
+		}
+		unpack(archives, prefixes, output, threads, mem_limit);
+	}
+}
@@ -0,0 +1,158 @@
+#include "synth.hpp"
+#include <chrono>
+#ifndef _WIN32
+#include <spawn.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+extern char** environ;
+#endif
+
+// Runs a tool to completion, measuring its wall time and peak RSS (where available)
+struct run_result {
+	int status;
+	double seconds;
+	uint64_t peak_rss;
+};
+static run_result run(std::vector<std::string> const& command) {
+	auto begin = std::chrono::steady_clock::now();
+	run_result result{};
+#ifdef _WIN32
+	std::string line;
+	for (auto& arg : command) line += "\"" + arg + "\" ";
+	result.status = std::system(line.c_str());
+#else
+	std::vector<char*> argv;
+	for (auto& arg : command) argv.push_back((char*)arg.c_str());
+	argv.push_back(nullptr);
+	pid_t pid;
+	CHECK(posix_spawn(&pid, argv[0], nullptr, nullptr, argv.data(), environ) == 0, "Failed to run " + command[0]);
+	int status; rusage usage{};
+	wait4(pid, &status, 0, &usage);
+	result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	result.peak_rss = (uint64_t)usage.ru_maxrss * 1024;
+#endif
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	return result;
+}
+
+int main(int, char* argv[]) {
+	argh::parser cmdl(argv, argh::parser::Mode::PREFER_PARAM_FOR_UNREG_OPTION);
+
+	struct {
+		std::string bindir;
+		std::string workdir;
+		synth::workload load;
+		bool compress, record_baseline;
+		double min_mbps, max_regression;
+		std::string baseline;
+		size_t threads, repeat;
+	} args;
+
+	auto c_bindir = cmdl({ "b", "bin" });
+	auto c_workdir = cmdl({ "w", "workdir" });
+	if (!c_bindir || !c_workdir) {
+		std::cerr << "End-to-end pack/unpack throughput harness\n";
+		std::cerr << "Note:\n";
+		std::cerr << "  - A synthetic workload (see mkarchive) is packed, unpacked and round-tripped with the actual tools.\n";
+		std::cerr << "  - Every unpacked tree is verified against the workload. Any mismatch fails the run, as does throughput below --min-mbps.\n";
+		std::cerr << "  - Every stage runs --repeat times (defaults to 1) into a fresh output, and the median time is reported.\n";
+		std::cerr << "  - With --baseline, a stage fails when it falls more than --max-regression (defaults to 0.5, i.e. half) below the\n";
+		std::cerr << "    throughput in the file. The file must exist: it is only written with --record-baseline.\n";
+		std::cerr << "Usage: " << argv[0] << " -b <directory containing cpk/mpk> -w <work directory> --format [cpk/mpk] -n [count] --min-size [bytes] --max-size [bytes] --compressibility [0..1] [--compress] --repeat [count] --min-mbps [MB/s] --baseline [file] [--record-baseline] --max-regression [0..1]\n";
+		return EXIT_FAILURE;
+	}
+	std::getline(c_bindir, args.bindir);
+	std::getline(c_workdir, args.workdir);
+	cmdl({ "n", "count" }, 1000) >> args.load.count;
+	args.load.min_size = parse_size(cmdl("min-size", "1K").str());
+	args.load.max_size = parse_size(cmdl("max-size", "64K").str());
+	cmdl("compressibility", 0.5) >> args.load.compressibility;
+	cmdl("seed", 0) >> args.load.seed;
+	cmdl("min-mbps", 0.0) >> args.min_mbps;
+	cmdl("max-regression", 0.5) >> args.max_regression;
+	args.baseline = cmdl("baseline", "").str();
+	cmdl({ "j", "threads" }, worker_pool::default_concurrency()) >> args.threads;
+	cmdl("repeat", 1) >> args.repeat;
+	args.repeat = std::max<size_t>(args.repeat, 1);
+	args.compress = cmdl["compress"];
+	args.record_baseline = cmdl["record-baseline"];
+	CHECK(!args.record_baseline || args.baseline.size(), "--record-baseline needs --baseline <file>");
+	std::string format = cmdl("format", "cpk").str();
+	args.load.type = format == "mpk" ? archive::format::MPK : archive::format::CPK;
+
+	using namespace std::filesystem;
+	path workdir(args.workdir);
+	remove_all(workdir);
+	path source = workdir / "source", unpacked = workdir / "unpacked", roundtrip = workdir / "roundtrip";
+	path packed = workdir / ("packed." + format), repacked = workdir / ("repacked." + format);
+	std::string tool = (path(args.bindir) / format).string();
+#ifdef _WIN32
+	tool += ".exe";
+#endif
+	synth::write_tree(args.load, source, args.threads);
+	const uint64_t total = synth::total_size(args.load);
+
+	// Stage -> MB/s of the baseline run
+	std::map<std::string, double> baseline, measured;
+	if (args.baseline.size() && !args.record_baseline) {
+		FILE* fp = fopen(args.baseline.c_str(), "r");
+		CHECK(fp, "Failed to open baseline file (record one with --record-baseline): " + args.baseline);
+		char stage[64]; double mbps;
+		while (fscanf(fp, "%63s %lf", stage, &mbps) == 2) baseline[stage] = mbps;
+		fclose(fp);
+	}
+	bool failed = false;
+	// Runs `once` --repeat times, each producing a clean output, and reports the median of their total times
+	auto report = [&](const char* stage, std::function<std::vector<run_result>()> const& once) {
+		std::vector<double> times; uint64_t peak_rss = 0;
+		for (size_t i = 0; i < args.repeat; i++) {
+			double seconds = 0;
+			for (auto& result : once()) {
+				seconds += result.seconds, peak_rss = std::max(peak_rss, result.peak_rss);
+				if (result.status != 0) failed = true, std::cerr << stage << ": tool exited with " << result.status << "\n";
+			}
+			times.push_back(seconds);
+		}
+		std::sort(times.begin(), times.end());
+		size_t mid = times.size() / 2;
+		double seconds = times.size() % 2 ? times[mid] : (times[mid - 1] + times[mid]) / 2;
+		double mbps = total / 1e6 / seconds;
+		printf("%-10s %10.3f s %10.2f MB/s %12.1f files/s %10.1f MB peak RSS\n", stage, seconds, mbps, args.load.count / seconds, peak_rss / 1e6);
+		if (mbps < args.min_mbps) failed = true, std::cerr << stage << ": below the " << args.min_mbps << " MB/s threshold\n";
+		if (baseline.contains(stage) && mbps < baseline[stage] * (1 - args.max_regression))
+			failed = true, std::cerr << stage << ": " << mbps << " MB/s regressed from the " << baseline[stage] << " MB/s baseline\n";
+		measured[stage] = mbps;
+	};
+	auto verify = [&](const char* stage, path const& outdir) {
+		if (size_t mismatches = synth::verify_tree(args.load, outdir, args.threads))
+			failed = true, std::cerr << stage << ": " << mismatches << " mismatched files\n";
+	};
+	printf("%s: %zu files, %.2f MB, compressibility %.2f%s\n", format.c_str(), args.load.count, total / 1e6, args.load.compressibility, args.compress ? ", compressed" : "");
+
+	std::vector<std::string> pack{ tool, "-o", source.string(), "-r", packed.string() };
+	if (args.compress) pack.push_back("--compress");
+	report("pack", [&] { remove(packed); return std::vector{ run(pack) }; });
+
+	report("unpack", [&] {
+		remove_all(unpacked);
+		return std::vector{ run({ tool, "-i", packed.string(), "-o", unpacked.string() }) };
+	});
+	verify("unpack", unpacked);
+
+	report("roundtrip", [&] {
+		remove(repacked), remove_all(roundtrip);
+		run_result repack = run({ tool, "-o", unpacked.string(), "-r", repacked.string() });
+		return std::vector{ repack, run({ tool, "-i", repacked.string(), "-o", roundtrip.string() }) };
+	});
+	verify("roundtrip", roundtrip);
+
+	remove_all(workdir);
+	if (args.record_baseline && !failed) {
+		FILE* fp = fopen(args.baseline.c_str(), "w");
+		CHECK(fp, "Failed to open baseline file: " + args.baseline);
+		for (auto& [stage, mbps] : measured) fprintf(fp, "%s %f\n", stage.c_str(), mbps);
+		fclose(fp);
+		printf("baseline recorded in %s\n", args.baseline.c_str());
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
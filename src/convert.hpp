@@ -0,0 +1,112 @@
+#pragma once
+#include "archive.hpp"
+// Archive to archive conversion (i.e. MPK <-> CPK), streamed from one archive straight into the other's packer
+namespace archive {
+	// Converts `input` into a `type` archive at `output`. Entries keep their ID order.
+	// - MPK entries are numbered contiguously, and named after the input entries' names (sans any 0x<id>_ prefix)
+	// - CPK (ITOC) entries keep their IDs, which must fit in 16 bits
+	// Entries that can be kept as stored are copied range to range (see io::append_extent). The rest, CRILAYLA entries going
+	// into an MPK and uncompressed ones to be compressed with `compress`, are transformed on `threads` workers ahead of the
+	// packer. Transformed data waiting on the packer never exceeds `mem_limit` bytes.
+	inline void convert(std::filesystem::path const& input, std::filesystem::path const& output, format type, bool compress, size_t threads, size_t mem_limit) {
+		using namespace std::filesystem;
+		index source = open(input);
+		std::vector<const entry*> entries;
+		for (auto& entry : source.entries) entries.push_back(&entry);
+		std::sort(entries.begin(), entries.end(), PRED(lhs->id < rhs->id));
+		io::file fin(source.path);
+		CHECK(fin, "Failed to open input file: " + source.path.string());
+		auto transformed = [&](const entry* entry) { return type == format::MPK ? entry->compressed : compress && !entry->compressed; };
+		auto unpacked_size = [&](const entry* entry) { return entry->compressed ? entry->size_decompressed : entry->size; };
+
+		struct slot {
+			u8vec data;
+			size_t reserved{ 0 };
+			bool ready{ false };
+		};
+		std::vector<slot> slots(entries.size());
+		std::mutex lock;
+		std::condition_variable ready;
+		pipeline::memory_budget budget(mem_limit);
+		worker_pool pool(threads);
+		// Submits the transforms in packing order, as the budget allows
+		std::thread feeder([&] {
+			for (size_t i = 0; i < entries.size(); i++) {
+				if (!transformed(entries[i])) continue;
+				// Stored and unpacked copies, plus the compressor's output and tables
+				size_t reserved = entries[i]->size + unpacked_size(entries[i]);
+				if (compress && type == format::CPK) reserved += cpk::crilayla::footprint(unpacked_size(entries[i]));
+				budget.acquire(reserved);
+				pool.submit([&, i, reserved, entry = entries[i]] {
+					u8stream stored(entry->size, false);
+					{
+						trace::scope _("read", "entry", entry->name);
+						CHECK(fin.read_at(stored.data(), entry->size, entry->offset) == entry->size, "Truncated archive");
+					}
+					u8vec data;
+					if (entry->compressed) {
+						trace::scope _("decompress", "entry", entry->name);
+						u8vec header;
+						cpk::crilayla::decompress(stored, header, data);
+						data.insert(data.begin(), header.begin(), header.end());
+					}
+					else data = std::move(stored.buffer);
+					if (compress && type == format::CPK) {
+						trace::scope _("compress", "entry", entry->name);
+						u8vec compressed = cpk::crilayla::compress(data);
+						if (compressed.size() && compressed.size() < data.size()) data = std::move(compressed);
+					}
+					{
+						std::scoped_lock guard(lock);
+						slots[i].data = std::move(data), slots[i].reserved = reserved, slots[i].ready = true;
+					}
+					ready.notify_all();
+				});
+			}
+		});
+		// Called by the packer, in order
+		auto take = [&](size_t i) -> u8vec {
+			std::unique_lock guard(lock);
+			ready.wait(guard, [&] { return slots[i].ready; });
+			u8vec data = std::move(slots[i].data);
+			budget.release(slots[i].reserved);
+			return data;
+		};
+
+		if (output.has_parent_path() && !exists(output.parent_path()))
+			create_directories(output.parent_path());
+		io::file fout(output, true);
+		CHECK(fout, "Failed to open output file: " + output.string());
+		if (type == format::MPK) {
+			mpk::file_entries files(entries.size());
+			for (size_t i = 0; i < entries.size(); i++) {
+				auto& file = files[i];
+				std::string name = source.type == format::MPK ? entries[i]->name.substr(entries[i]->name.find('_') + 1) : entries[i]->name;
+				file.entry.entry_id = (uint32_t)i;
+				snprintf(file.entry.filename, sizeof(file.entry.filename), "%s", name.c_str());
+				file.entry.size = unpacked_size(entries[i]);
+				file.path = entries[i]->name;
+				if (transformed(entries[i])) file.source = [&, i](uint8_t* dst) {
+					u8vec data = take(i);
+					memcpy(dst, data.data(), data.size());
+				};
+				else file.reference = { &fin, entries[i]->offset, entries[i]->size };
+			}
+			mpk::pack(fout, files);
+		}
+		else {
+			package::file_entries files(entries.size());
+			for (size_t i = 0; i < entries.size(); i++) {
+				auto& file = files[i];
+				CHECK(entries[i]->id <= 0xFFFF, "ITOC IDs are 16 bits wide");
+				file.id = (uint16_t)entries[i]->id;
+				file.size = unpacked_size(entries[i]);
+				file.path = entries[i]->name;
+				if (transformed(entries[i])) file.stored = [&, i] { return take(i); };
+				else file.reference = { &fin, entries[i]->offset, entries[i]->size };
+			}
+			package::ITOC().pack(fout, files);
+		}
+		feeder.join();
+	}
+}
@@ -0,0 +1,901 @@
+#pragma once
+#include "pch.hpp"
+#include "trace.hpp"
+#include "io.hpp"
+#include "worker_pool.hpp"
+#include "pipeline.hpp"
+namespace cpk {
+	constexpr uint32_t CPK_MAGIC = fourCC('C', 'P', 'K', ' ');
+	constexpr uint32_t CPK_MAGIC_BIG = fourCC(' ', 'K', 'P', 'C');
+	constexpr uint32_t UTF_MAGIC = fourCC('@', 'U', 'T', 'F');
+	constexpr uint32_t UTF_MAGIC_BIG = fourCC('F', 'T', 'U', '@');
+	constexpr uint32_t ITOC_MAGIC = fourCC('I', 'T', 'O', 'C');
+	constexpr uint32_t ITOC_MAGIC_BIG = fourCC('C', 'O', 'T', 'I');
+	constexpr uint64_t CRILAYLA_MAGIC = fourCC('C', 'R', 'I', 'L') | (uint64_t)fourCC('A', 'Y', 'L', 'A') << 32;
+	
+	namespace crilayla {
+		static void decompress(u8stream& stream, u8vec& header, u8vec& buffer) {
+			CHECK(!stream.is_big_endian());
+			CHECK(stream.read<uint64_t>() == CRILAYLA_MAGIC);
+
+			uint32_t uncompressed_size, compressed_size;
+			stream >> uncompressed_size >> compressed_size;
+
+			header.resize(0x100);
+			stream.read_at(header.data(), 0x100, compressed_size + 0x10, false);
+
+			uint32_t data_size = uncompressed_size;
+			uint32_t data_written = 0;
+			buffer.resize(data_size);
+
+			std::span<uint8_t> compressed(stream.begin(), stream.begin() + compressed_size);
+			std::reverse(compressed.begin(), compressed.end());
+
+			uint32_t bit_pos = 0;
+			auto read_n = [&](char nbits) -> uint16_t {
+				CHECK(nbits <= sizeof(uint16_t) * 8);
+				uint16_t ans = 0;
+				while (bit_pos / 8 < compressed_size && nbits--)
+					ans <<= 1, ans |= ((compressed[bit_pos / 8] >> (7 - bit_pos % 8 /* LE */)) & 1), bit_pos++;
+				return ans;
+				};
+			auto all_n_bits = [](auto value, char n) -> bool { return value == (1 << n) - 1; };
+
+			while (data_written < data_size)
+			{
+				uint8_t ctl = read_n(1);
+				if (ctl) {
+					auto offset = read_n(13) + 3; // backwards from the *back* of the output stream
+					uint32_t ref_count = 3; // previous bytes referenced. 3 minimum
+					constexpr uint8_t vle_n_bits[]{ 2, 3, 5, 8 };
+					for (int i = 0, n_bits = vle_n_bits[0];; i++, i = std::min(i, 3), n_bits = vle_n_bits[i]) {
+						uint16_t vle_length = read_n(n_bits);
+						ref_count += vle_length;
+						if (!all_n_bits(vle_length, n_bits))
+							break;
+					}
+					// fill in the referenced bytes from the *back* of the output buffer
+					offset = data_size - 1 - data_written + offset;
+					while (ref_count--) {
+						buffer[data_size - 1 - data_written] = buffer[offset--];
+						data_written++;
+					}
+				}
+				else {
+					uint8_t byte = read_n(8); // verbatim byte. into the back.
+					buffer[data_size - 1 - data_written] = byte;
+					data_written++;
+				}
+
+			}
+		}
+		constexpr size_t HEADER_SIZE = 0x100, MIN_MATCH = 3, MAX_DISTANCE = (1 << 13) - 1 + 3, HASH_BITS = 15, MAX_CHAIN = 32;
+		// Match chains are only followed MAX_DISTANCE back, so they're kept for a window of the latest positions only
+		constexpr size_t WINDOW = std::bit_ceil(MAX_DISTANCE + 1);
+		// Worst case memory `compress` takes for a file of `size` bytes, on top of the input: the output
+		// (9 bits per byte if nothing matches, plus the header and the raw leading bytes) and the match tables.
+		static constexpr size_t footprint(size_t size) {
+			return 0x10 + (size * 9 + 7) / 8 + HEADER_SIZE + ((1 << HASH_BITS) + WINDOW) * sizeof(int32_t);
+		}
+		// Compresses a file into a CRILAYLA stream that `decompress` restores.
+		// The first 0x100 bytes are stored as is, the rest is LZ compressed back to front.
+		// Returns an empty buffer if the file is too small to be compressed.
+		static u8vec compress(std::span<const uint8_t> input) {
+			if (input.size() <= HEADER_SIZE) return {};
+			// The decoder fills its output from the back, so matching is done on the data read back to front
+			const uint8_t* last = input.data() + input.size() - 1;
+			auto data = [last](size_t pos) { return last[-(ptrdiff_t)pos]; };
+			const size_t size = input.size() - HEADER_SIZE;
+
+			// The output is built in place: the stream header, then the bits (reversed once done), then the raw leading bytes
+			u8vec bits(0x10);
+			bits.reserve(footprint(input.size()) - ((1 << HASH_BITS) + WINDOW) * sizeof(int32_t));
+			uint8_t current = 0, used = 0;
+			auto write_n = [&](uint32_t value, uint8_t nbits) {
+				while (nbits--) {
+					current = (current << 1) | ((value >> nbits) & 1);
+					if (++used == 8) bits.push_back(current), current = used = 0;
+				}
+			};
+			pool::vector<int32_t> head(1 << HASH_BITS, -1), prev(WINDOW, -1);
+			auto hash = [&](size_t pos) { return ((data(pos) << 16 | data(pos + 1) << 8 | data(pos + 2)) * 2654435761u) >> (32 - HASH_BITS); };
+			auto insert = [&](size_t pos) {
+				if (pos + MIN_MATCH > size) return;
+				uint32_t h = hash(pos);
+				prev[pos & (WINDOW - 1)] = head[h], head[h] = (int32_t)pos;
+			};
+			for (size_t pos = 0; pos < size;) {
+				size_t best_length = 0, best_distance = 0;
+				if (pos + MIN_MATCH <= size) {
+					int32_t candidate = head[hash(pos)];
+					// Candidates within MAX_DISTANCE (< WINDOW) haven't had their window slot reused yet
+					for (size_t chain = 0; candidate >= 0 && chain < MAX_CHAIN; chain++, candidate = prev[candidate & (WINDOW - 1)]) {
+						size_t distance = pos - candidate;
+						if (distance > MAX_DISTANCE) break;
+						if (distance < MIN_MATCH) continue;
+						size_t length = 0;
+						while (pos + length < size && data(candidate + length) == data(pos + length)) length++;
+						if (length > best_length) best_length = length, best_distance = distance;
+					}
+				}
+				if (best_length >= MIN_MATCH) {
+					write_n(1, 1);
+					write_n(best_distance - 3, 13);
+					// Variable length encoded count past the minimum. Each all-ones group continues into the next.
+					constexpr uint8_t vle_n_bits[]{ 2, 3, 5, 8 };
+					size_t remain = best_length - MIN_MATCH;
+					for (int i = 0;; i = std::min(i + 1, 3)) {
+						uint32_t max = (1 << vle_n_bits[i]) - 1, value = (uint32_t)std::min<size_t>(remain, max);
+						write_n(value, vle_n_bits[i]);
+						remain -= value;
+						if (value != max) break;
+					}
+					for (size_t end = pos + best_length; pos < end; pos++) insert(pos);
+				}
+				else {
+					write_n(0, 1);
+					write_n(data(pos), 8);
+					insert(pos++);
+				}
+			}
+			if (used) bits.push_back(current << (8 - used));
+			std::reverse(bits.begin() + 0x10, bits.end());
+			uint32_t sizes[2] = { (uint32_t)size, (uint32_t)(bits.size() - 0x10) };
+			memcpy(bits.data(), &CRILAYLA_MAGIC, sizeof(CRILAYLA_MAGIC)), memcpy(bits.data() + 8, sizes, sizeof(sizes));
+			bits.insert(bits.end(), input.begin(), input.begin() + HEADER_SIZE);
+			return bits;
+		}
+	};
+
+	namespace utf {
+		enum class field_type {
+			UINT8 = 0, INT8 = 1,
+			UINT16 = 2, INT16 = 3,
+			UINT32 = 4, INT32 = 5,
+			UINT64 = 6, INT64 = 7,
+			FLOAT = 8, DOUBLE = 9,
+			// Pointer (32bit) types
+			STRING = 0xA, DATA_ARRAY = 0xB,
+			INVALID = -1,
+		};
+		constexpr size_t field_sizes[] = { sizeof(uint8_t), sizeof(int8_t), sizeof(uint16_t), sizeof(int16_t), sizeof(uint32_t), sizeof(int32_t), sizeof(uint64_t), sizeof(int64_t), sizeof(float), sizeof(double), sizeof(uint32_t), sizeof(uint32_t) * 2 /* Offset, Length */ };
+		typedef std::variant<uint8_t, int8_t, uint16_t, int16_t, uint32_t, int32_t, uint64_t, int64_t, float, double, std::string, u8vec> field;
+		template<Fundamental Cast> inline std::optional<Cast> field_cast(utf::field const& field) {
+			return std::visit([&](auto&& arg) -> std::optional<Cast> {
+				using T = std::decay_t<decltype(arg)>;
+				if constexpr (std::is_convertible_v<T, Cast>) return arg;
+				return {};
+			}, field);
+		}
+		// Tables with at least twice as many rows are decoded on several threads, in ranges of at least this many rows.
+		constexpr size_t PARALLEL_ROWS = 16384;
+		// Calls `decode(begin, end)` over rows [0, count). Rows don't depend on each other, so large tables
+		// are split into ranges decoded concurrently. Smaller ones, and tables parsed from a pool worker
+		// (which would oversubscribe the cores the pool already occupies), stay on the calling thread.
+		template<typename Fn> inline void for_row_ranges(size_t count, Fn&& decode) {
+			if (worker_pool::on_worker()) return decode(0, count);
+			size_t threads = std::min(worker_pool::default_concurrency(), count / PARALLEL_ROWS);
+			if (threads < 2) return decode(0, count);
+			size_t step = (count + threads - 1) / threads;
+			std::vector<std::thread> workers;
+			for (size_t begin = step; begin < count; begin += step)
+				workers.emplace_back([&, begin] { decode(begin, std::min(begin + step, count)); });
+			decode(0, step);
+			for (auto& worker : workers) worker.join();
+		}
+		template<Fundamental T> inline void store_big_endian(uint8_t* dst, T value) {
+			memcpy(dst, &value, sizeof(T));
+			std::reverse(dst, dst + sizeof(T));
+		}
+		struct table_header {
+			uint32_t magic;
+			uint32_t _pad;
+			uint64_t length;
+		};
+		struct table_sub_header {
+			uint32_t magic;
+			uint32_t length;
+			uint32_t rowOffset;
+			uint32_t stringPoolOffset;
+			uint32_t dataPoolOffset;
+			uint32_t nameOffset;
+			uint16_t fieldCount;
+			uint16_t rowStride;
+			uint32_t rowCount;
+
+			const uint32_t to_block_offset(uint32_t hdr_offset) const { return hdr_offset + 8; }
+			const uint32_t from_block_offset(uint32_t blk_offset) const { return blk_offset - 8; }
+		};
+		struct table_field {
+			std::string name;
+			bool hasDefaultValue{ false };
+			bool isValid{ false };
+			field_type type{ field_type::INVALID };
+			std::vector<field> values;
+
+			table_field() = default;
+			table_field(std::string const& name) : name(name) {}
+			table_field(std::string const& name, field_type type, bool valid) : name(name), type(type), isValid(valid) {}
+			table_field(std::string const& name, std::vector<field> const& values) : name(name), values(values) {
+				type = (field_type)values.front().index();
+				isValid = true;
+			}
+			void reset(field_type ntype, bool valid = false) { type = ntype, isValid = valid; }
+			void push_back(field const& value) {
+				if (type == field_type::INVALID) type = (field_type)value.index();
+				CHECK((field_type)value.index() == type, "Invalid field type");
+				values.push_back(value);
+				isValid = true;
+			}
+		};
+		struct table_stream : public u8stream {
+			table_sub_header header{};
+
+			table_stream(uint32_t magic) : u8stream(0, true) { header.magic = magic; }
+			table_stream(u8vec&& buffer) : u8stream(std::move(buffer), true) { read_header(); }
+			table_stream(u8vec const& buffer) : u8stream(buffer, true) { read_header(); }
+			void read_header() {
+				*this >> header.magic >> header.length;
+				CHECK(header.magic == UTF_MAGIC_BIG);
+				*this >> header.rowOffset >> header.stringPoolOffset >> header.dataPoolOffset >> header.nameOffset >> header.fieldCount >> header.rowStride >> header.rowCount;
+			}
+			void write_header() {
+				*this << header.magic << header.length;
+				*this << header.rowOffset << header.stringPoolOffset << header.dataPoolOffset << header.nameOffset << header.fieldCount << header.rowStride << header.rowCount;
+			}
+			std::string read_null_string() {
+				uint32_t offset; *this >> offset;
+				uint32_t pos = header.to_block_offset(header.stringPoolOffset) + offset; offset = pos;
+				while (buffer[pos]) pos++;
+				return { buffer.begin() + offset, buffer.begin() + pos };
+			}
+			u8vec read_data_array() {
+				uint32_t offset, length; *this >> offset >> length;
+				uint32_t pos = header.to_block_offset(header.dataPoolOffset) + offset; offset = pos;
+				pos += length;
+				return { buffer.begin() + offset, buffer.begin() + pos };
+			}
+			field read_variant(field_type type) {
+				using enum field_type;
+				switch (type) {
+				case UINT8: return read<uint8_t>(); break;
+				case INT8: return read<int8_t>(); break;
+				case UINT16: return read<uint16_t>(); break;
+				case INT16: return read<int16_t>(); break;
+				case UINT32: return read<uint32_t>(); break;
+				case INT32: return read<int32_t>(); break;
+				case UINT64: return read<uint64_t>(); break;
+				case INT64: return read<int64_t>(); break;
+				case FLOAT: return read<float>(); break;
+				case DOUBLE: return read<double>(); break;
+				case STRING: return read_null_string(); break;
+				case DATA_ARRAY: return read_data_array(); break;
+				default:
+					return 0;
+				};
+			}
+			// Same as read_variant, from `offset` (advanced past the value) instead of the stream position.
+			// Doesn't touch the stream, so rows can be read concurrently.
+			template<Fundamental T> T read_next(size_t& offset) {
+				T value = read_at<T>(offset);
+				offset += sizeof(T);
+				return value;
+			}
+			field read_variant_at(field_type type, size_t& offset) {
+				using enum field_type;
+				switch (type) {
+				case UINT8: return read_next<uint8_t>(offset);
+				case INT8: return read_next<int8_t>(offset);
+				case UINT16: return read_next<uint16_t>(offset);
+				case INT16: return read_next<int16_t>(offset);
+				case UINT32: return read_next<uint32_t>(offset);
+				case INT32: return read_next<int32_t>(offset);
+				case UINT64: return read_next<uint64_t>(offset);
+				case INT64: return read_next<int64_t>(offset);
+				case FLOAT: return read_next<float>(offset);
+				case DOUBLE: return read_next<double>(offset);
+				case STRING: {
+					uint32_t pos = header.to_block_offset(header.stringPoolOffset) + read_next<uint32_t>(offset), begin = pos;
+					while (buffer[pos]) pos++;
+					return std::string(buffer.begin() + begin, buffer.begin() + pos);
+				}
+				case DATA_ARRAY: {
+					uint32_t begin = header.to_block_offset(header.dataPoolOffset) + read_next<uint32_t>(offset), length = read_next<uint32_t>(offset);
+					return u8vec(buffer.begin() + begin, buffer.begin() + begin + length);
+				}
+				default:
+					return 0;
+				};
+			}
+		};
+		struct table {
+			seq_ordered_named_stroage<std::string, table_field> fields;
+		private:
+			table_header hdr{};
+			table_stream stream;
+			void read_fields() {
+				trace::scope _("table parse");
+				stream.seek(0); stream.read_header();
+				fields.reset();
+				for (int i = 0; i < stream.header.fieldCount; i++) {
+					uint8_t flags = stream.read<uint8_t>();
+					table_field field;
+					field.type = (field_type)(flags & 0xF);
+					field.name = (flags & 0x10) ? stream.read_null_string() : "";
+					field.hasDefaultValue = (flags & 0x20) != 0;
+					field.isValid = ((flags & 0x40) != 0);
+					if (field.hasDefaultValue)
+						field.push_back(stream.read_variant((field_type)field.type));
+					fields[field.name] = field;
+				}
+				// Row columns are sized up front, then filled by row ranges (see for_row_ranges)
+				std::vector<table_field*> columns;
+				for (auto& field : fields)
+					if (!field.hasDefaultValue && field.isValid) {
+						CHECK((size_t)field.type < std::size(field_sizes), "Invalid field type");
+						field.values.resize(stream.header.rowCount), columns.push_back(&field);
+					}
+				const size_t base = stream.header.to_block_offset(stream.header.rowOffset), stride = stream.header.rowStride;
+				if (columns.size()) for_row_ranges(stream.header.rowCount, [&](size_t begin, size_t end) {
+					trace::scope _("table rows");
+					for (size_t row = begin; row < end; row++) {
+						size_t offset = base + row * stride;
+						for (auto column : columns) column->values[row] = stream.read_variant_at(column->type, offset);
+					}
+				});
+			}
+			// Lays out the entire table before writing anything. Duplicate strings (i.e. column names, file names)
+			// are interned and stored only once, and everything is then serialized into a single exactly sized buffer.
+			void write_fields() {
+				trace::scope _("table write");
+				// CPK string pool always has two strings before anything. And the look up process skips the first two char** as well.
+				// See: __int64 __fastcall criUtfRtv_LookUp(struct_a1 *a1, char *flag, char **strings)
+				constexpr char padding[] = "<NULL>\0El Psy Kongroo\0";
+				std::unordered_map<std::string_view, uint32_t> strings;
+				uint32_t stringPoolSize = sizeof(padding), dataPoolSize = 0;
+				auto intern = [&](std::string const& str) {
+					if (strings.try_emplace(str, stringPoolSize).second) stringPoolSize += str.size() + 1;
+				};
+				auto reserve = [&](field const& value) {
+					if (auto str = std::get_if<std::string>(&value)) intern(*str);
+					else if (auto data = std::get_if<u8vec>(&value)) dataPoolSize += data->size();
+				};
+				uint32_t schemaSize = 0, rowStride = 0, rowCount = fields.size() ? fields[0].values.size() : 0;
+				std::vector<table_field*> columns;
+				for (auto& field : fields) {
+					schemaSize += sizeof(uint8_t);
+					if (field.name.size()) intern(field.name), schemaSize += sizeof(uint32_t);
+					if (field.hasDefaultValue) reserve(field.values[0]), schemaSize += field_sizes[(size_t)field.type];
+					else if (field.isValid) columns.push_back(&field), rowStride += field_sizes[(size_t)field.type];
+				}
+				for (uint32_t i = 0; i < rowCount; i++)
+					for (auto column : columns) reserve(column->values[i]);
+
+				uint32_t rowOffset = sizeof(table_sub_header) + schemaSize;
+				uint32_t stringPoolOffset = rowOffset + rowStride * rowCount;
+				uint32_t dataPoolOffset = stringPoolOffset + stringPoolSize;
+				stream.buffer.clear();
+				stream.buffer.resize(dataPoolOffset + dataPoolSize, 0);
+				uint8_t* base = stream.data(), * cursor = base + sizeof(table_sub_header);
+				uint32_t dataPoolCursor = 0;
+				auto put_string = [&](std::string const& str) {
+					store_big_endian<uint32_t>(cursor, strings.at(str)), cursor += sizeof(uint32_t);
+				};
+				auto put = [&](field const& value) {
+					std::visit([&](auto&& arg) {
+						using T = std::decay_t<decltype(arg)>;
+						if constexpr (std::is_same_v<T, std::string>) {
+							put_string(arg);
+						}
+						else if constexpr (std::is_same_v<T, u8vec>) {
+							store_big_endian<uint32_t>(cursor, dataPoolCursor), cursor += sizeof(uint32_t);
+							store_big_endian<uint32_t>(cursor, arg.size()), cursor += sizeof(uint32_t);
+							memcpy(base + dataPoolOffset + dataPoolCursor, arg.data(), arg.size()), dataPoolCursor += arg.size();
+						}
+						else {
+							store_big_endian<T>(cursor, arg), cursor += sizeof(T);
+						}
+						}, value);
+				};
+				for (auto const& field : fields) {
+					uint8_t flags = (int)field.type;
+					if (field.name.size()) flags |= 0x10;
+					if (field.hasDefaultValue) flags |= 0x20;
+					if (field.isValid) flags |= 0x40;
+					*cursor++ = flags;
+					if (field.name.size()) put_string(field.name);
+					if (field.hasDefaultValue) put(field.values[0]);
+				}
+				for (uint32_t i = 0; i < rowCount; i++)
+					for (auto column : columns) put(column->values[i]);
+				memcpy(base + stringPoolOffset, padding, sizeof(padding));
+				for (auto& [str, offset] : strings) memcpy(base + stringPoolOffset + offset, str.data(), str.size());
+
+				stream.header.fieldCount = fields.size();
+				stream.header.rowCount = rowCount, stream.header.rowStride = rowStride;
+				stream.header.rowOffset = stream.header.from_block_offset(rowOffset);
+				stream.header.stringPoolOffset = stream.header.from_block_offset(stringPoolOffset);
+				stream.header.dataPoolOffset = stream.header.from_block_offset(dataPoolOffset);
+				stream.header.length = stream.size() - 8;  // E06100311:UTF header size error. (%d)+(8)>(%d). This DOES NOT contain the magic & padding
+				stream.seek(0);
+				stream.write_header();
+			}
+		public:
+			static void mask_table_data(u8vec& buffer) {
+				for (int i = 0, j = 25951; i < buffer.size(); i++, j *= 16661)
+					buffer[i] ^= (j & 0xFF);
+			}
+			static u8vec read_table_data(FILE* fp, uint32_t magic) {
+				table_header hdr;
+				u8vec buffer;
+				{
+					trace::scope _("toc read");
+					fread(&hdr, sizeof(hdr), 1, fp);
+					CHECK(hdr.magic == magic);
+					buffer.resize(hdr.length); fread(buffer.data(), 1, hdr.length, fp);
+				}
+				if (memcmp(buffer.data(), &UTF_MAGIC, sizeof(uint32_t)) != 0) {
+					// Some CPK files has a simple XOR cipher
+					trace::scope _("unmask");
+					mask_table_data(buffer);
+				}
+				return buffer;
+			}
+
+			table(uint32_t magic) : stream(magic) {}
+			table(u8vec&& buffer) : stream(std::move(buffer)) {
+				read_fields();
+			}
+			table(u8vec const& buffer) : stream(buffer) {
+				read_fields();
+			}
+			uint32_t get_row_count() const { return stream.header.rowCount; }
+			table_stream& commit_to_stream() {
+				write_fields();
+				return stream;
+			}
+			void reload_from_stream() {
+				read_fields();
+			}
+		};
+
+		// Fixed schemas
+		// Well-known tables are declared once as a struct and a `schema<Struct>::columns` tuple of columns.
+		// `decode` checks the stored column list against it once, then fills the structs straight from the
+		// row data by precomputed offsets. Tables that don't match (missing columns, other types) go through
+		// `table` instead, with missing columns left zeroed.
+		template<typename T> constexpr field_type field_type_of() {
+			using enum field_type;
+			if constexpr (std::is_same_v<T, uint8_t>) return UINT8;
+			else if constexpr (std::is_same_v<T, int8_t>) return INT8;
+			else if constexpr (std::is_same_v<T, uint16_t>) return UINT16;
+			else if constexpr (std::is_same_v<T, int16_t>) return INT16;
+			else if constexpr (std::is_same_v<T, uint32_t>) return UINT32;
+			else if constexpr (std::is_same_v<T, int32_t>) return INT32;
+			else if constexpr (std::is_same_v<T, uint64_t>) return UINT64;
+			else if constexpr (std::is_same_v<T, int64_t>) return INT64;
+			else if constexpr (std::is_same_v<T, float>) return FLOAT;
+			else if constexpr (std::is_same_v<T, double>) return DOUBLE;
+			else if constexpr (std::is_same_v<T, std::string>) return STRING;
+			else if constexpr (std::is_same_v<T, u8vec>) return DATA_ARRAY;
+			else static_assert(!sizeof(T), "Not a UTF field type");
+		}
+		template<typename Struct, typename T> struct column {
+			typedef T type;
+			std::string_view name;
+			T Struct::* member;
+			static constexpr field_type stored_type = field_type_of<T>();
+		};
+		template<typename Struct, typename T> column(std::string_view, T Struct::*) -> column<Struct, T>;
+		template<typename Struct> struct schema;
+
+		// Stored column list of a table. Values are only located, not decoded.
+		struct layout {
+			enum class storage { NONE, DEFAULT, ROW };
+			struct column {
+				std::string_view name;
+				field_type type;
+				storage where;
+				uint32_t offset; // Absolute for DEFAULT. Within the row for ROW.
+			};
+			const u8vec& buffer;
+			table_sub_header header{};
+			std::vector<column> columns;
+			bool valid{ false };
+
+			template<Fundamental T> T load(uint64_t offset) const {
+				T value{};
+				if (offset + sizeof(T) > buffer.size()) return value;
+				std::reverse_copy(buffer.data() + offset, buffer.data() + offset + sizeof(T), (uint8_t*)&value);
+				return value;
+			}
+			template<typename T> T value(uint64_t offset) const {
+				if constexpr (std::is_same_v<T, std::string>) {
+					uint64_t begin = header.to_block_offset(header.stringPoolOffset) + load<uint32_t>(offset);
+					if (begin >= buffer.size()) return {};
+					const char* str = (const char*)buffer.data() + begin;
+					return std::string(str, strnlen(str, buffer.size() - begin));
+				}
+				else if constexpr (std::is_same_v<T, u8vec>) {
+					uint64_t begin = header.to_block_offset(header.dataPoolOffset) + load<uint32_t>(offset), length = load<uint32_t>(offset + 4);
+					if (begin + length > buffer.size()) return {};
+					return u8vec(buffer.begin() + begin, buffer.begin() + begin + length);
+				}
+				else return load<T>(offset);
+			}
+			layout(u8vec const& buffer) : buffer(buffer) {
+				if (buffer.size() < sizeof(table_sub_header) || load<uint32_t>(0) != UTF_MAGIC_BIG) return;
+				header = { load<uint32_t>(0), load<uint32_t>(4), load<uint32_t>(8), load<uint32_t>(12), load<uint32_t>(16), load<uint32_t>(20), load<uint16_t>(24), load<uint16_t>(26), load<uint32_t>(28) };
+				uint64_t cursor = sizeof(table_sub_header), pool = header.to_block_offset(header.stringPoolOffset);
+				uint32_t row_offset = 0;
+				for (uint16_t i = 0; i < header.fieldCount; i++) {
+					if (cursor >= buffer.size()) return;
+					uint8_t flags = buffer[cursor++];
+					column field{ .type = (field_type)(flags & 0xF), .where = storage::NONE };
+					if ((size_t)field.type >= std::size(field_sizes)) return;
+					if (flags & 0x10) {
+						uint64_t begin = pool + load<uint32_t>(cursor);
+						if (begin >= buffer.size()) return;
+						const char* str = (const char*)buffer.data() + begin;
+						field.name = std::string_view(str, strnlen(str, buffer.size() - begin));
+						cursor += sizeof(uint32_t);
+					}
+					if (flags & 0x20) field.where = storage::DEFAULT, field.offset = cursor, cursor += field_sizes[(size_t)field.type];
+					else if (flags & 0x40) field.where = storage::ROW, field.offset = row_offset, row_offset += field_sizes[(size_t)field.type];
+					columns.push_back(field);
+				}
+				valid = row_offset <= header.rowStride && header.to_block_offset(header.rowOffset) + (uint64_t)header.rowStride * header.rowCount <= buffer.size();
+			}
+			const column* find(std::string_view name) const {
+				for (auto& column : columns) if (column.name == name) return &column;
+				return nullptr;
+			}
+		};
+
+		template<typename Struct> std::vector<Struct> decode_generic(u8vec const& buffer) {
+			table generic(buffer);
+			std::vector<Struct> rows(generic.get_row_count());
+			std::apply([&](auto const&... columns) {
+				([&](auto const& column) {
+					typedef typename std::decay_t<decltype(column)>::type T;
+					std::string name(column.name);
+					if (!generic.fields.contains(name)) return;
+					auto& values = generic.fields[name].values;
+					for (size_t i = 0; i < rows.size() && values.size(); i++) {
+						auto& value = values[std::min(i, values.size() - 1)];
+						if constexpr (Fundamental<T>) rows[i].*column.member = field_cast<T>(value).value_or(T{});
+						else if (auto ptr = std::get_if<T>(&value)) rows[i].*column.member = *ptr;
+					}
+				}(columns), ...);
+			}, schema<Struct>::columns);
+			return rows;
+		}
+		template<typename Struct> std::vector<Struct> decode(u8vec const& buffer) {
+			trace::scope _("table decode");
+			if (buffer.empty()) return {};
+			constexpr auto& columns = schema<Struct>::columns;
+			layout stored(buffer);
+			std::array<const layout::column*, std::tuple_size_v<std::decay_t<decltype(columns)>>> found{};
+			bool matches = stored.valid;
+			std::apply([&](auto const&... columns) {
+				size_t i = 0;
+				((found[i] = stored.find(columns.name), matches &= found[i] && found[i]->type == columns.stored_type, i++), ...);
+			}, columns);
+			if (!matches) return decode_generic<Struct>(buffer);
+			std::vector<Struct> rows(stored.header.rowCount);
+			const uint64_t base = stored.header.to_block_offset(stored.header.rowOffset), stride = stored.header.rowStride;
+			for_row_ranges(rows.size(), [&](size_t begin, size_t end) {
+				std::apply([&](auto const&... columns) {
+					size_t i = 0;
+					([&](auto const& column, layout::column const& where) {
+						typedef typename std::decay_t<decltype(column)>::type T;
+						if (where.where == layout::storage::ROW)
+							for (size_t row = begin; row < end; row++) rows[row].*column.member = stored.value<T>(base + row * stride + where.offset);
+						else if (where.where == layout::storage::DEFAULT) {
+							T value = stored.value<T>(where.offset);
+							for (size_t row = begin; row < end; row++) rows[row].*column.member = value;
+						}
+					}(columns, *found[i++]), ...);
+				}, columns);
+			});
+			return rows;
+		}
+		// Builds a table out of `rows`, every column stored per row
+		template<typename Struct> table encode(std::span<const Struct> rows, uint32_t magic = UTF_MAGIC_BIG) {
+			table result(magic);
+			std::apply([&](auto const&... columns) {
+				([&](auto const& column) {
+					auto& field = result.fields[std::string(column.name)];
+					field.reset(column.stored_type);
+					for (auto& row : rows) field.push_back(row.*column.member);
+				}(columns), ...);
+			}, schema<Struct>::columns);
+			return result;
+		}
+
+		// CPK header table
+		struct cpk_header {
+			uint64_t ContentOffset, ContentSize, ItocOffset, ItocSize;
+			uint16_t Align;
+			uint32_t CpkMode;
+		};
+		template<> struct schema<cpk_header> {
+			static constexpr auto columns = std::make_tuple(
+				column{ "ContentOffset", &cpk_header::ContentOffset }, column{ "ContentSize", &cpk_header::ContentSize },
+				column{ "ItocOffset", &cpk_header::ItocOffset }, column{ "ItocSize", &cpk_header::ItocSize },
+				column{ "Align", &cpk_header::Align }, column{ "CpkMode", &cpk_header::CpkMode }
+			);
+		};
+		// ITOC table. Each of the data arrays is a table of files in turn.
+		struct itoc_header {
+			u8vec DataL, DataH;
+		};
+		template<> struct schema<itoc_header> {
+			static constexpr auto columns = std::make_tuple(column{ "DataL", &itoc_header::DataL }, column{ "DataH", &itoc_header::DataH });
+		};
+		// Files up to 64KB
+		struct itoc_data_l {
+			uint16_t ID, FileSize, ExtractSize;
+		};
+		template<> struct schema<itoc_data_l> {
+			static constexpr auto columns = std::make_tuple(column{ "ID", &itoc_data_l::ID }, column{ "FileSize", &itoc_data_l::FileSize }, column{ "ExtractSize", &itoc_data_l::ExtractSize });
+		};
+		struct itoc_data_h {
+			uint16_t ID;
+			uint32_t FileSize, ExtractSize;
+		};
+		template<> struct schema<itoc_data_h> {
+			static constexpr auto columns = std::make_tuple(column{ "ID", &itoc_data_h::ID }, column{ "FileSize", &itoc_data_h::FileSize }, column{ "ExtractSize", &itoc_data_h::ExtractSize });
+		};
+	}
+}
+
+namespace package {
+	using namespace cpk;
+	// A file to be packed, `size` bytes long. Its contents come from the first of these that's set:
+	// `reference`, `stored`, `contents`, `source`, then the file at `path`.
+	// Generated files can be packed straight from memory with `contents` or `source`, without touching the disk.
+	struct file_entry {
+		uint16_t id;
+		uint64_t size;
+		std::string path;
+		std::optional<std::string> storedPath;
+		// The file's contents, already in memory. Must stay valid until packed.
+		std::span<const uint8_t> contents;
+		// Produces the file's contents instead of reading them from `path` when set
+		std::function<void(uint8_t* dst)> source;
+		// Produces the bytes to store as is, CRILAYLA compressed or not, instead of the above. `size` is then their decompressed size.
+		std::function<u8vec()> stored;
+		// Identical stored bytes (possibly compressed) to be shared instead of writing the file. See io::append_extent
+		io::extent reference;
+	};
+	typedef std::vector<file_entry> file_entries;
+	struct packed_file_entry {
+		uint16_t id;
+		uint64_t offset;
+		uint64_t size;
+		uint64_t size_decompressed;
+		std::optional<std::string> storedPath;
+	};
+	typedef std::vector<packed_file_entry> packed_file_entries;
+	struct scheme {
+		virtual void pack(io::file& out, file_entries& files) = 0;
+		virtual packed_file_entries unpack(FILE* fp) = 0;
+	};
+	/* -- CPK Package schemes -- */
+	/*
+	ITOC scheme
+	- Filenames are unavailable in this mode
+	- The files are stored (and sorted) by their IDs and optionally compressed
+	- With `compress`, entries are CRILAYLA compressed (see crilayla::compress) on `threads` workers ahead of
+	  the writes. Each in-flight entry is charged its size plus crilayla::footprint against `mem_limit`
+	*/
+	struct ITOC : public scheme {
+		// CRILAYLA compress entries while packing. Entries that don't shrink are stored as is.
+		bool compress{ false };
+		// Compress on this many workers, ahead of the writes, holding up to `mem_limit` bytes of read-ahead and working sets.
+		// `source`s are then called from the workers, concurrently.
+		size_t threads{ 1 }, mem_limit{ 512 << 20 };
+
+		static constexpr uint32_t ITOC_HDR_LENGTH_OFFSET = 0x10;
+		static constexpr uint16_t Align = 2048;
+		static constexpr uint64_t ItocOffset = 0x800;
+
+		// DataL only stores files up to 64KB (UINT16), DataH the rest (up to 2GB).
+		// Split by extracted size alone, which never changes while packing (the stored size can't exceed it).
+		static bool in_data_l(uint64_t extract_size) { return extract_size <= UINT16_MAX; }
+		// The table columns are fixed width. Hence the ITOC can be overwritten in place as long as the
+		// files, and which table each of them goes to (see in_data_l), stay the same.
+		static utf::table_header write_itoc(io::file& out, std::vector<utf::itoc_data_h> const& rows) {
+			std::vector<utf::itoc_data_l> dataL;
+			std::vector<utf::itoc_data_h> dataH;
+			for (auto& row : rows) {
+				if (in_data_l(row.ExtractSize)) dataL.push_back({ row.ID, (uint16_t)row.FileSize, (uint16_t)row.ExtractSize });
+				else dataH.push_back(row);
+			}
+			utf::itoc_header itoc{
+				.DataL = utf::encode<utf::itoc_data_l>(dataL).commit_to_stream().buffer,
+				.DataH = utf::encode<utf::itoc_data_h>(dataH).commit_to_stream().buffer
+			};
+			utf::table Itoc = utf::encode<utf::itoc_header>({ &itoc, 1 });
+			auto& ItocBuffer = Itoc.commit_to_stream().buffer;
+			utf::table_header itocHdr{
+				.magic = ITOC_MAGIC,
+				.length = (uint32_t)ItocBuffer.size() + ITOC_HDR_LENGTH_OFFSET
+			};
+			utf::table::mask_table_data(ItocBuffer);
+			ItocBuffer.insert(ItocBuffer.begin(), (uint8_t*)&itocHdr, (uint8_t*)&itocHdr + sizeof(itocHdr));
+			CHECK(out.write_at(ItocBuffer.data(), ItocBuffer.size(), ItocOffset) == ItocBuffer.size(), "Failed to write output file");
+			return itocHdr;
+		}
+		// Likewise for the CPK header table, which is all fixed width
+		static void write_header(io::file& out, uint64_t ContentOffset, uint64_t ContentEnd, uint64_t ItocSize) {
+			utf::cpk_header header{
+				.ContentOffset = ContentOffset,
+				.ContentSize = ContentEnd - ContentOffset,
+				.ItocOffset = ItocOffset,
+				.ItocSize = ItocSize,
+				// CPK Flags
+				.Align = Align,
+				.CpkMode = 0x00
+			};
+			utf::table CPK = utf::encode<utf::cpk_header>({ &header, 1 });
+			auto& CPKBuffer = CPK.commit_to_stream().buffer;
+			utf::table::mask_table_data(CPKBuffer);
+			utf::table_header cpkHdr{
+				.magic = CPK_MAGIC,
+				.length = (uint32_t)CPKBuffer.size()
+			};
+			CPKBuffer.insert(CPKBuffer.begin(), (uint8_t*)&cpkHdr, (uint8_t*)&cpkHdr + sizeof(cpkHdr));
+			CHECK(out.write_at(CPKBuffer.data(), CPKBuffer.size(), 0) == CPKBuffer.size(), "Failed to write output file");
+		}
+
+		// The header and ITOC are positional writes around the content, which goes through an io::writer
+		virtual void pack(io::file& out, file_entries& files) {
+			// ITOC
+			std::sort(files.begin(), files.end(), PRED(lhs.id < rhs.id));
+			std::vector<uint64_t> fileSizes;
+			for (auto& file : files) fileSizes.push_back(file.size);
+			// Written with the uncompressed sizes first, and overwritten once the actual sizes are known
+			auto itoc_rows = [&]() {
+				std::vector<utf::itoc_data_h> dataH(files.size());
+				for (size_t i = 0; i < files.size(); i++)
+					dataH[i] = { files[i].id, (uint32_t)fileSizes[i], (uint32_t)files[i].size };
+				return dataH;
+			};
+			utf::table_header itocHdr = write_itoc(out, itoc_rows());
+			// Content
+			uint64_t ContentOffset = alignUp(ItocOffset + itocHdr.length, Align);
+			io::writer fp(out, ContentOffset);
+			auto compressible = [&](file_entry const& file) { return compress && !file.reference && !file.stored; };
+			// Bytes to store for a file to be compressed. Files that don't shrink are stored as is.
+			auto load = [&](file_entry const& file) -> u8vec {
+				u8vec buffer;
+				std::span<const uint8_t> contents = file.contents;
+				if (!contents.data()) {
+					trace::scope _("read", "entry", file.path);
+					buffer.resize(file.size);
+					if (file.source) file.source(buffer.data());
+					else {
+						io::file fin(file.path);
+						if (!fin) return {};
+						fin.read_at(buffer.data(), file.size, 0);
+					}
+					contents = buffer;
+				}
+				trace::scope _("compress", "entry", file.path);
+				u8vec result = crilayla::compress(contents);
+				if (result.size() && result.size() < contents.size()) return result;
+				if (buffer.empty()) buffer.assign(contents.begin(), contents.end());
+				return buffer;
+			};
+			// With more than one thread, files to be compressed are handed to workers in packing order, as the budget allows
+			struct slot {
+				u8vec data;
+				bool ready{ false };
+			};
+			std::vector<slot> slots(files.size());
+			std::mutex lock;
+			std::condition_variable ready;
+			pipeline::memory_budget budget(mem_limit);
+			// The file read in, and the compressor's output and tables
+			auto charge = [&](size_t i) { return files[i].size + crilayla::footprint(files[i].size); };
+			std::unique_ptr<worker_pool> pool;
+			std::thread feeder;
+			if (compress && threads > 1) {
+				pool.reset(new worker_pool(threads));
+				feeder = std::thread([&] {
+					for (size_t i = 0; i < files.size(); i++) {
+						if (!compressible(files[i])) continue;
+						budget.acquire(charge(i));
+						pool->submit([&, i] {
+							u8vec data = load(files[i]);
+							{
+								std::scoped_lock guard(lock);
+								slots[i].data = std::move(data), slots[i].ready = true;
+							}
+							ready.notify_all();
+						});
+					}
+				});
+			}
+			auto take = [&](size_t i) -> u8vec {
+				if (!pool) return load(files[i]);
+				std::unique_lock guard(lock);
+				ready.wait(guard, [&] { return slots[i].ready; });
+				u8vec data = std::move(slots[i].data);
+				guard.unlock();
+				budget.release(charge(i));
+				return data;
+			};
+			u8vec buffer;
+			for (size_t i = 0; i < files.size(); i++) {
+				auto& file = files[i];
+				if (file.reference) {
+					// Offsets are implied by the sizes here. Entries can't be moved to line up with the reference.
+					trace::scope _("clone", "entry", file.path);
+					io::append_extent(fp, file.reference);
+					fileSizes[i] = file.reference.size;
+					fp.seek(alignUp(fp.tell(), Align));
+					continue;
+				}
+				std::span<const uint8_t> data;
+				if (file.stored) {
+					trace::scope _("read", "entry", file.path);
+					buffer = file.stored();
+					data = buffer;
+				}
+				else if (compress) {
+					buffer = take(i);
+					if (buffer.empty() && file.size) continue;
+					data = buffer;
+				}
+				else if (file.contents.data()) data = file.contents;
+				else {
+					trace::scope _("read", "entry", file.path);
+					buffer.resize(file.size);
+					if (file.source) file.source(buffer.data());
+					else {
+						io::file fin(file.path);
+						if (!fin) continue;
+						fin.read_at(buffer.data(), file.size, 0);
+					}
+					data = buffer;
+				}
+				fileSizes[i] = data.size();
+				trace::scope _("write", "entry", file.path);
+				fp.write(data.data(), data.size());
+				fp.seek(alignUp(fp.tell(), Align));
+			}
+			if (feeder.joinable()) feeder.join();
+			uint64_t ContentEnd = fp.tell();
+			fp.flush();
+			bool resized = false;
+			for (size_t i = 0; i < files.size(); i++) resized |= fileSizes[i] != files[i].size;
+			if (resized) CHECK(write_itoc(out, itoc_rows()).length == itocHdr.length, "ITOC size changed");
+			write_header(out, ContentOffset, ContentEnd, itocHdr.length);
+		}
+		virtual packed_file_entries unpack(FILE* fp) {
+			packed_file_entries files;
+			auto headers = utf::decode<utf::cpk_header>(utf::table::read_table_data(fp, CPK_MAGIC));
+			CHECK(headers.size() && headers[0].ItocOffset && headers[0].Align, "Not an ITOC CPK");
+			auto& CPK = headers[0];
+			fseek(fp, CPK.ItocOffset, SEEK_SET);
+			auto itocs = utf::decode<utf::itoc_header>(utf::table::read_table_data(fp, ITOC_MAGIC));
+			CHECK(itocs.size(), "Empty ITOC");
+			for (auto& row : utf::decode<utf::itoc_data_l>(itocs[0].DataL))
+				files.push_back({ row.ID, 0, row.FileSize, row.ExtractSize });
+			for (auto& row : utf::decode<utf::itoc_data_h>(itocs[0].DataH))
+				files.push_back({ row.ID, 0, row.FileSize, row.ExtractSize });
+			uint64_t ContentOffset = CPK.ContentOffset;
+			uint16_t Align = CPK.Align;
+			std::sort(files.begin(), files.end(), PRED(lhs.id < rhs.id));
+			uint64_t offset = ContentOffset;
+			for (auto& file : files) {
+				file.offset = offset;
+				offset += file.size; offset = alignUp(offset, Align);
+			}
+			return files;
+		}
+	};
+}
@@ -0,0 +1,109 @@
+#pragma once
+#include "archive.hpp"
+#include "hash.hpp"
+// Archive comparison straight from the TOCs, without extracting either side
+namespace archive {
+	struct diff_result {
+		std::vector<const entry*> added, removed;
+		std::vector<PAIR2(const entry*)> changed;
+	};
+
+	// Matching key of an entry. CPK (ITOC) entries only have IDs. MPK entries can also be
+	// matched by their stored file name, which survives IDs shifting between versions.
+	inline std::string diff_key(index const& archive, entry const& entry, bool by_name) {
+		if (by_name && archive.type == format::MPK) return entry.name.substr(entry.name.find('_') + 1);
+		return std::to_string(entry.id);
+	}
+
+	inline uint64_t hash_entry(io::file& fin, entry const& entry) {
+		constexpr size_t chunk_size = 1 << 20;
+		thread_local u8vec buffer(chunk_size);
+		trace::scope _("hash", "entry", entry.name);
+		xxh64 state;
+		for (uint64_t offset = 0; offset < entry.size; offset += chunk_size) {
+			size_t size = std::min<uint64_t>(chunk_size, entry.size - offset);
+			CHECK(fin.read_at(buffer.data(), size, entry.offset + offset) == size, "Truncated archive");
+			state.update(buffer.data(), size);
+		}
+		return state.digest();
+	}
+	// Hash of the unpacked contents. CRILAYLA entries are decompressed first.
+	inline uint64_t hash_unpacked(io::file& fin, entry const& entry) {
+		if (!entry.compressed) return hash_entry(fin, entry);
+		thread_local u8vec header, data;
+		trace::scope _("hash", "entry", entry.name);
+		u8stream stored(entry.size, false);
+		CHECK(fin.read_at(stored.data(), entry.size, entry.offset) == entry.size, "Truncated archive");
+		cpk::crilayla::decompress(stored, header, data);
+		xxh64 state;
+		state.update(header.data(), header.size()), state.update(data.data(), data.size());
+		return state.digest();
+	}
+
+	// Entries of differing unpacked sizes are changed right away. The others are hashed, in parallel: as stored first,
+	// then unpacked where that differs and either side is compressed (i.e. recompressed, or now stored uncompressed).
+	inline diff_result diff(index const& from, index const& to, bool by_name, worker_pool& pool) {
+		diff_result result;
+		std::map<std::string, const entry*> lhs, rhs;
+		for (auto [archive, keyed] : { std::pair{ &from, &lhs }, std::pair{ &to, &rhs } })
+			for (auto& entry : archive->entries) {
+				std::string key = diff_key(*archive, entry, by_name);
+				// Only names can repeat, and matching either copy would be a guess
+				CHECK(keyed->insert({ key, &entry }).second, "Duplicate entry " + key + " in " + archive->path.string() + ", compare by ID instead");
+			}
+		std::vector<PAIR2(const entry*)> candidates;
+		for (auto& [key, entry] : lhs) {
+			auto it = rhs.find(key);
+			if (it == rhs.end()) result.removed.push_back(entry);
+			else if (entry->size_decompressed != it->second->size_decompressed) result.changed.push_back({ entry, it->second });
+			else candidates.push_back({ entry, it->second });
+		}
+		for (auto& [key, entry] : rhs)
+			if (!lhs.contains(key)) result.added.push_back(entry);
+
+		io::file fin_from(from.path), fin_to(to.path);
+		CHECK(fin_from && fin_to, "Failed to open input file");
+		std::vector<uint8_t> differs(candidates.size());
+		for (size_t i = 0; i < candidates.size(); i++)
+			pool.submit([&, i] {
+				auto [lhs, rhs] = candidates[i];
+				if (lhs->size == rhs->size && lhs->compressed == rhs->compressed) {
+					if (hash_entry(fin_from, *lhs) == hash_entry(fin_to, *rhs)) return;
+					if (!lhs->compressed) { differs[i] = true; return; }
+				}
+				else if (!lhs->compressed && !rhs->compressed) { differs[i] = true; return; }
+				differs[i] = hash_unpacked(fin_from, *lhs) != hash_unpacked(fin_to, *rhs);
+			});
+		pool.wait();
+		for (size_t i = 0; i < candidates.size(); i++)
+			if (differs[i]) result.changed.push_back(candidates[i]);
+		std::sort(result.changed.begin(), result.changed.end(), PRED(lhs.second->id < rhs.second->id));
+		return result;
+	}
+
+	// Prints the difference between two archives. When `patchdir` is set, the added and changed
+	// entries of `to` are unpacked into it (see archive::unpack), named as they would be when unpacked.
+	inline void diff(std::string const& from, std::string const& to, std::filesystem::path const& patchdir, bool by_name, size_t threads, size_t mem_limit) {
+		worker_pool pool(threads);
+		index lhs, rhs;
+		pool.submit([&] { lhs = open(from); });
+		pool.submit([&] { rhs = open(to); });
+		pool.wait();
+		diff_result result = diff(lhs, rhs, by_name, pool);
+		for (auto entry : result.removed)
+			std::cout << "- " << entry->name << " (" << entry->size_decompressed << " bytes)\n";
+		for (auto entry : result.added)
+			std::cout << "+ " << entry->name << " (" << entry->size_decompressed << " bytes)\n";
+		for (auto& [old_entry, new_entry] : result.changed)
+			std::cout << "M " << new_entry->name << " (" << old_entry->size_decompressed << " -> " << new_entry->size_decompressed << " bytes)\n";
+		std::cerr << result.added.size() << " added, " << result.removed.size() << " removed, " << result.changed.size() << " changed\n";
+		if (!patchdir.empty()) {
+			index patch{ rhs.path, rhs.type, {} };
+			for (auto entry : result.added) patch.entries.push_back(*entry);
+			for (auto& [old_entry, new_entry] : result.changed) patch.entries.push_back(*new_entry);
+			directory_sink sink(patchdir);
+			unpack({ patch }, { "" }, sink, threads, mem_limit);
+			sink.finish();
+		}
+	}
+}
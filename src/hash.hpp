@@ -0,0 +1,51 @@
+#pragma once
+#include "pch.hpp"
+// Streaming XXH64
+// See: https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+struct xxh64 {
+private:
+	static constexpr uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL, P3 = 0x165667B19E3779F9ULL, P4 = 0x85EBCA77C2B2AE63ULL, P5 = 0x27D4EB2F165667C5ULL;
+	static constexpr uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+	static constexpr uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * P2, 31) * P1; }
+	static constexpr uint64_t merge(uint64_t acc, uint64_t val) { return (acc ^ round(0, val)) * P1 + P4; }
+	static uint64_t read64(const uint8_t* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+	static uint32_t read32(const uint8_t* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+	uint64_t seed, total{ 0 };
+	uint64_t v[4];
+	uint8_t tail[32];
+	size_t tail_size{ 0 };
+public:
+	xxh64(uint64_t seed = 0) : seed(seed), v{ seed + P1 + P2, seed + P2, seed, seed - P1 } {}
+	void update(const void* data, size_t size) {
+		const uint8_t* p = (const uint8_t*)data;
+		total += size;
+		if (tail_size) {
+			size_t take = std::min(size, sizeof(tail) - tail_size);
+			memcpy(tail + tail_size, p, take);
+			tail_size += take, p += take, size -= take;
+			if (tail_size < sizeof(tail)) return;
+			for (int i = 0; i < 4; i++) v[i] = round(v[i], read64(tail + i * 8));
+			tail_size = 0;
+		}
+		for (; size >= 32; p += 32, size -= 32)
+			for (int i = 0; i < 4; i++) v[i] = round(v[i], read64(p + i * 8));
+		memcpy(tail, p, size), tail_size = size;
+	}
+	uint64_t digest() const {
+		uint64_t h = total >= 32 ? rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18) : seed + P5;
+		if (total >= 32) for (int i = 0; i < 4; i++) h = merge(h, v[i]);
+		h += total;
+		const uint8_t* p = tail; size_t size = tail_size;
+		for (; size >= 8; p += 8, size -= 8) h = rotl(h ^ round(0, read64(p)), 27) * P1 + P4;
+		for (; size >= 4; p += 4, size -= 4) h = rotl(h ^ (read32(p) * P1), 23) * P2 + P3;
+		for (; size; p++, size--) h = rotl(h ^ (*p * P5), 11) * P1;
+		h ^= h >> 33, h *= P2, h ^= h >> 29, h *= P3, h ^= h >> 32;
+		return h;
+	}
+	static uint64_t hash(const void* data, size_t size, uint64_t seed = 0) {
+		xxh64 state(seed);
+		state.update(data, size);
+		return state.digest();
+	}
+};
@@ -0,0 +1,88 @@
+#pragma once
+#include "archive.hpp"
+// Entry inventory: file types told apart by magic, without extracting anything.
+// CRILAYLA keeps the first 0x100 bytes of the file uncompressed, right after the compressed data,
+// so compressed entries are classified from those. Either way only a few hundred bytes are read per entry.
+namespace archive {
+	constexpr size_t SNIFF_SIZE = 0x100;
+
+	// File type of contents starting with `data`
+	inline const char* sniff(const uint8_t* data, size_t size) {
+		auto starts_with = [&](std::string_view magic, size_t at = 0) {
+			return size >= at + magic.size() && !memcmp(data + at, magic.data(), magic.size());
+		};
+		if (starts_with("DDS ")) return "dds";
+		if (starts_with("OggS")) return "ogg";
+		if (starts_with("CRID")) return "usm";
+		if (starts_with("AFS2")) return "awb";
+		if (starts_with("@UTF")) return "utf";
+		if (starts_with("CPK ")) return "cpk";
+		if (starts_with(std::string_view("MPK\0", 4))) return "mpk";
+		if (starts_with(std::string_view("SC3\0", 4))) return "sc3";
+		if (starts_with(std::string_view("MES\0", 4))) return "mes";
+		if (starts_with("\x89PNG")) return "png";
+		if (starts_with("\xFF\xD8\xFF")) return "jpg";
+		if (starts_with("RIFF") && starts_with("WAVE", 8)) return "wav";
+		if (starts_with("\x1A\x45\xDF\xA3")) return "webm";
+		if (starts_with("ftyp", 4)) return "mp4";
+		if (starts_with("PK\x03\x04")) return "zip";
+		// HCA headers may have their high bits set (masked)
+		if (size >= 4 && (data[0] & 0x7F) == 'H' && (data[1] & 0x7F) == 'C' && (data[2] & 0x7F) == 'A' && !(data[3] & 0x7F)) return "hca";
+		if (size >= 2 && data[0] == 0x80 && data[1] == 0x00) return "adx";
+		if (starts_with("<?xml")) return "xml";
+		if (starts_with("\xEF\xBB\xBF")) return "text";
+		if (!size) return "empty";
+		if (std::all_of(data, data + size, [](uint8_t c) { return c >= 0x20 || c == '\t' || c == '\n' || c == '\r' || c >= 0x80; })) return "text";
+		return "unknown";
+	}
+
+	// Leading bytes (up to SNIFF_SIZE) of an entry's unpacked contents
+	inline size_t sniff_bytes(io::file& fin, entry const& entry, uint8_t* dst) {
+		if (!entry.compressed) return fin.read_at(dst, std::min<uint64_t>(entry.size, SNIFF_SIZE), entry.offset);
+		// CRILAYLA: magic, uncompressed size, compressed size, then the compressed data and the raw leading bytes
+		uint8_t header[0x10];
+		if (fin.read_at(header, sizeof(header), entry.offset) != sizeof(header)) return 0;
+		uint32_t compressed_size;
+		memcpy(&compressed_size, header + 0xC, sizeof(compressed_size));
+		return fin.read_at(dst, std::min<uint64_t>(entry.size_decompressed, SNIFF_SIZE), entry.offset + 0x10 + compressed_size);
+	}
+
+	// Writes one JSON object per entry (JSON lines) to `output`: archive, id, name, type, size (unpacked),
+	// stored size, compressed flag and ratio (stored / unpacked). Entries are classified on `threads` workers.
+	// A per type summary goes to stderr.
+	inline void inventory(std::vector<std::string> const& inputs, FILE* output, size_t threads) {
+		std::vector<std::filesystem::path> paths = collect_inputs(inputs);
+		CHECK(paths.size(), "No CPK/MPK archives found in input");
+		worker_pool pool(threads);
+		std::vector<index> archives(paths.size());
+		for (size_t i = 0; i < paths.size(); i++)
+			pool.submit([&, i] { archives[i] = open(paths[i]); });
+		pool.wait();
+		struct summary { size_t count{ 0 }; uint64_t size{ 0 }, stored{ 0 }; };
+		std::map<std::string, summary> totals;
+		for (auto& archive : archives) {
+			io::file fin(archive.path);
+			CHECK(fin, "Failed to open input file: " + archive.path.string());
+			std::vector<const char*> types(archive.entries.size());
+			for (size_t i = 0; i < archive.entries.size(); i++)
+				pool.submit([&, i] {
+					auto& entry = archive.entries[i];
+					trace::scope _("sniff", "entry", entry.name);
+					uint8_t leading[SNIFF_SIZE];
+					types[i] = sniff(leading, sniff_bytes(fin, entry, leading));
+				});
+			pool.wait();
+			std::string name = trace::escape(archive.path.filename().string());
+			for (size_t i = 0; i < archive.entries.size(); i++) {
+				auto& entry = archive.entries[i];
+				uint64_t size = entry.compressed ? entry.size_decompressed : entry.size;
+				fprintf(output, "{\"archive\":\"%s\",\"id\":%u,\"name\":\"%s\",\"type\":\"%s\",\"size\":%" PRIu64 ",\"stored\":%" PRIu64 ",\"compressed\":%s,\"ratio\":%.4f}\n",
+					name.c_str(), entry.id, trace::escape(entry.name).c_str(), types[i], size, entry.size, entry.compressed ? "true" : "false", size ? (double)entry.size / size : 1.0);
+				auto& total = totals[types[i]];
+				total.count++, total.size += size, total.stored += entry.size;
+			}
+		}
+		for (auto& [type, total] : totals)
+			fprintf(stderr, "%-8s %8zu files %14" PRIu64 " bytes %14" PRIu64 " stored\n", type.c_str(), total.count, total.size, total.stored);
+	}
+}
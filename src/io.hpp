@@ -0,0 +1,444 @@
+#pragma once
+#include "pch.hpp"
+#ifdef _WIN32
+#include <cstdio>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+namespace io {
+	// Opt-in O_DIRECT for every io::file opened afterwards. See file::open
+	inline bool& direct_io() {
+		static bool enabled = false;
+		return enabled;
+	}
+	// Offset, size and address alignment used for O_DIRECT transfers. 4K satisfies every common logical block size.
+	constexpr size_t DIRECT_ALIGNMENT = 4096;
+	// Per-thread bounce buffer for O_DIRECT transfers that aren't aligned as is.
+	// Allocated once per thread and reused for every transfer. Pooled blocks this size are page aligned.
+	constexpr size_t DIRECT_BUFFER_SIZE = 4 << 20;
+	inline uint8_t* direct_buffer() {
+		thread_local u8vec pooled(DIRECT_BUFFER_SIZE);
+		return pooled.data();
+	}
+
+	// Handle to a directory whose files are opened by name relative to it (openat), without resolving its path every time.
+	// NOTE: On Windows this only keeps the path
+	struct directory {
+		std::filesystem::path path;
+#ifndef _WIN32
+		int fd{ -1 };
+#endif
+		directory(std::filesystem::path const& path) : path(path) {
+#ifndef _WIN32
+			fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+#endif
+		}
+		directory(directory const&) = delete;
+		~directory() {
+#ifndef _WIN32
+			if (fd >= 0) ::close(fd);
+#endif
+		}
+	};
+
+	// Positional file handle. Reads and writes never move a shared cursor, so
+	// a single handle can be shared by every worker touching the same archive.
+	// NOTE: On Windows this falls back to a locked FILE*
+	struct file {
+	private:
+#ifdef _WIN32
+		FILE* fp{ nullptr };
+		std::mutex lock;
+#else
+		int fd{ -1 };
+		std::atomic<bool> direct{ false };
+		uint64_t length{ 0 }; // Logical size of what's been written. Direct writes are padded past it.
+		bool padded{ false };
+
+		// O_DIRECT was rejected by the filesystem after all. Continues with buffered I/O.
+		void drop_direct() {
+#ifdef O_DIRECT
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+#endif
+			direct = false;
+		}
+		bool direct_error() const { return direct && errno == EINVAL; }
+		bool aligned(const void* ptr, size_t size, uint64_t offset) const {
+			return !((uintptr_t)ptr % DIRECT_ALIGNMENT) && !(size % DIRECT_ALIGNMENT) && !(offset % DIRECT_ALIGNMENT);
+		}
+		size_t pread_all(void* dst, size_t size, uint64_t offset) {
+			size_t done = 0;
+			while (done < size) {
+				ssize_t n = ::pread(fd, (uint8_t*)dst + done, size - done, offset + done);
+				if (n < 0 && direct_error()) { drop_direct(); continue; }
+				if (n <= 0) break;
+				done += n;
+			}
+			return done;
+		}
+		size_t pwrite_all(const void* src, size_t size, uint64_t offset) {
+			size_t done = 0;
+			while (done < size) {
+				ssize_t n = ::pwrite(fd, (const uint8_t*)src + done, size - done, offset + done);
+				if (n < 0 && direct_error()) { drop_direct(); continue; }
+				if (n <= 0) break;
+				done += n;
+			}
+			return done;
+		}
+#endif
+	public:
+		file() = default;
+		file(std::filesystem::path const& path, bool writable = false, bool truncate = true) { open(path, writable, truncate); }
+		file(file const&) = delete;
+		file& operator=(file const&) = delete;
+		~file() { close(); }
+
+		// Writable files are created, or truncated unless `truncate` is false (i.e. to be patched in place)
+		bool open(std::filesystem::path const& path, bool writable = false, bool truncate = true) {
+#ifdef _WIN32
+			close();
+			fp = _wfopen(path.c_str(), writable ? (truncate ? L"wb+" : L"rb+") : L"rb");
+			return is_open();
+#else
+			return open_at(AT_FDCWD, path, writable, truncate);
+#endif
+		}
+		// Opens `name` in `dir`
+		bool open(directory const& dir, std::filesystem::path const& name, bool writable = false) {
+#ifdef _WIN32
+			return open(dir.path / name, writable);
+#else
+			return open_at(dir.fd, name, writable);
+#endif
+		}
+#ifndef _WIN32
+		bool open_at(int dir, std::filesystem::path const& path, bool writable, bool truncate = true) {
+			close();
+			int flags = writable ? (O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0) | O_CLOEXEC) : (O_RDONLY | O_CLOEXEC);
+			length = 0, padded = false, direct = false;
+#ifdef O_DIRECT
+			// Filesystems without O_DIRECT support (i.e. tmpfs) reject it upfront. Those are opened buffered instead.
+			if (direct_io()) {
+				fd = ::openat(dir, path.c_str(), flags | O_DIRECT, 0644);
+				direct = fd >= 0;
+			}
+#endif
+			if (fd < 0) fd = ::openat(dir, path.c_str(), flags, 0644);
+			struct stat st {};
+			if (fd >= 0 && !(flags & O_TRUNC) && fstat(fd, &st) == 0) length = st.st_size;
+			return is_open();
+		}
+#endif
+		void close() {
+#ifdef _WIN32
+			if (fp) fclose(fp), fp = nullptr;
+#else
+			if (fd >= 0) {
+				// Direct writes of unaligned tails overshoot the actual end of file
+				if (padded) ftruncate(fd, length);
+				::close(fd), fd = -1;
+			}
+#endif
+		}
+#ifdef _WIN32
+		bool is_open() const { return fp != nullptr; }
+		bool is_direct() const { return false; }
+#else
+		bool is_open() const { return fd >= 0; }
+		bool is_direct() const { return direct; }
+		int native_handle() const { return fd; }
+#endif
+		explicit operator bool() const { return is_open(); }
+		// Accounts for bytes written around write_at (i.e. copy_file_range), so they're kept by the truncation on close
+		void written(uint64_t end) {
+#ifndef _WIN32
+			length = std::max(length, end);
+#endif
+		}
+
+		enum class advice { SEQUENTIAL, WILLNEED, DONTNEED };
+		// Access pattern hint for [offset, offset + length). A zero length extends to the end of the file.
+		// No-op where unsupported.
+		void advise(advice hint, uint64_t offset = 0, uint64_t length = 0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+			constexpr int hints[] = { POSIX_FADV_SEQUENTIAL, POSIX_FADV_WILLNEED, POSIX_FADV_DONTNEED };
+			posix_fadvise(fd, offset, length, hints[(int)hint]);
+#endif
+		}
+		// Reserves `size` bytes for the file in one go, instead of growing it write by write.
+		// Best effort. Filesystems without fallocate support are left alone.
+		void preallocate(uint64_t size) {
+#ifdef __linux__
+			if (size) fallocate(fd, 0, 0, size);
+#endif
+		}
+
+		size_t read_at(void* dst, size_t size, uint64_t offset) {
+#ifdef _WIN32
+			std::scoped_lock guard(lock);
+			_fseeki64(fp, offset, SEEK_SET);
+			return fread(dst, 1, size, fp);
+#else
+			if (!direct || aligned(dst, size, offset)) return pread_all(dst, size, offset);
+			// Unaligned reads go through the bounce buffer, block aligned on both ends
+			uint8_t* bounce = direct_buffer();
+			size_t done = 0;
+			while (done < size) {
+				if (!direct) return done + pread_all((uint8_t*)dst + done, size - done, offset + done);
+				uint64_t begin = (offset + done) & ~(uint64_t)(DIRECT_ALIGNMENT - 1);
+				uint64_t end = std::min<uint64_t>(alignUp(offset + size, DIRECT_ALIGNMENT), begin + DIRECT_BUFFER_SIZE);
+				size_t n = pread_all(bounce, end - begin, begin), skip = offset + done - begin;
+				if (n <= skip) break;
+				n = std::min<size_t>(n - skip, size - done);
+				memcpy((uint8_t*)dst + done, bounce + skip, n);
+				done += n;
+				if (begin + skip + n < end && done < size) break; // EOF
+			}
+			return done;
+#endif
+		}
+		size_t write_at(const void* src, size_t size, uint64_t offset) {
+#ifdef _WIN32
+			std::scoped_lock guard(lock);
+			_fseeki64(fp, offset, SEEK_SET);
+			return fwrite(src, 1, size, fp);
+#else
+			length = std::max(length, offset + size);
+			if (!direct || aligned(src, size, offset)) return pwrite_all(src, size, offset);
+			// Unaligned writes go through the bounce buffer. Partially covered blocks on either
+			// end are read back first, and the file is truncated to `length` on close.
+			// NOTE: Not safe against concurrent writers sharing a block
+			uint8_t* bounce = direct_buffer();
+			size_t done = 0;
+			while (done < size) {
+				if (!direct) return done + pwrite_all((const uint8_t*)src + done, size - done, offset + done);
+				uint64_t begin = (offset + done) & ~(uint64_t)(DIRECT_ALIGNMENT - 1);
+				uint64_t end = std::min<uint64_t>(alignUp(offset + size, DIRECT_ALIGNMENT), begin + DIRECT_BUFFER_SIZE);
+				size_t skip = offset + done - begin, n = std::min<size_t>(end - begin - skip, size - done);
+				if (skip) {
+					size_t got = pread_all(bounce, DIRECT_ALIGNMENT, begin);
+					memset(bounce + got, 0, DIRECT_ALIGNMENT - got);
+				}
+				if (skip + n < end - begin) {
+					uint64_t last = end - DIRECT_ALIGNMENT;
+					if (last != begin || !skip) {
+						size_t got = pread_all(bounce + (last - begin), DIRECT_ALIGNMENT, last);
+						memset(bounce + (last - begin) + got, 0, DIRECT_ALIGNMENT - got);
+					}
+					padded = true;
+				}
+				memcpy(bounce + skip, (const uint8_t*)src + done, n);
+				if (pwrite_all(bounce, end - begin, begin) != end - begin) break;
+				done += n;
+			}
+			return done;
+#endif
+		}
+		// Writes `first` followed by `second` at `offset`, with a single (vectored) write where possible
+		size_t write_at(std::span<const uint8_t> first, std::span<const uint8_t> second, uint64_t offset) {
+#ifndef _WIN32
+			if (!direct) {
+				length = std::max(length, offset + first.size() + second.size());
+				iovec parts[2] = { { (void*)first.data(), first.size() }, { (void*)second.data(), second.size() } };
+				iovec* part = parts;
+				int count = 2;
+				size_t done = 0, total = first.size() + second.size();
+				while (done < total) {
+					ssize_t n = ::pwritev(fd, part, count, offset + done);
+					if (n <= 0) break;
+					done += n;
+					// Short write. Skips what made it.
+					while (count && (size_t)n >= part->iov_len) n -= part->iov_len, part++, count--;
+					if (count) part->iov_base = (uint8_t*)part->iov_base + n, part->iov_len -= n;
+				}
+				return done;
+			}
+#endif
+			size_t done = write_at(first.data(), first.size(), offset);
+			if (done != first.size()) return done;
+			return done + write_at(second.data(), second.size(), offset + first.size());
+		}
+	};
+
+	// Sequential writes into a file, as FILE* would, minus the page cache with --direct-io.
+	// Writes are gathered in a page aligned buffer and go out as large positional writes. Short forward seeks
+	// (i.e. alignment padding) are zero filled within the buffer, so that a packed archive is written in
+	// aligned blocks as a single run. Seeking alone doesn't extend the file.
+	struct writer {
+		static constexpr size_t BUFFER_SIZE = 4 << 20;
+	private:
+		file& out;
+		u8vec buffer;
+		uint64_t start{ 0 }, position{ 0 }; // Where `buffer` goes, and the cursor
+		uint64_t end() const { return start + buffer.size(); }
+	public:
+		writer(file& out, uint64_t position = 0) : out(out), start(position), position(position) { buffer.reserve(BUFFER_SIZE); }
+		writer(writer const&) = delete;
+		~writer() { flush(); }
+
+		file& target() { return out; }
+		uint64_t tell() const { return position; }
+		void seek(uint64_t offset) { position = offset; }
+		void flush() {
+			if (buffer.size()) CHECK(out.write_at(buffer.data(), buffer.size(), start) == buffer.size(), "Failed to write output file");
+			start = end(), buffer.clear();
+		}
+		void write(const void* data, size_t size) {
+			if (position != end()) {
+				if (buffer.size() && position > end() && position - end() < DIRECT_ALIGNMENT) buffer.resize(buffer.size() + (position - end()), 0);
+				else flush(), start = position;
+			}
+			const uint8_t* src = (const uint8_t*)data;
+			// Large aligned runs skip the buffer
+			if (buffer.empty() && size >= BUFFER_SIZE && !(start % DIRECT_ALIGNMENT)) {
+				size_t bulk = size & ~(DIRECT_ALIGNMENT - 1);
+				CHECK(out.write_at(src, bulk, start) == bulk, "Failed to write output file");
+				start += bulk, src += bulk, size -= bulk;
+			}
+			while (size) {
+				size_t n = std::min(size, BUFFER_SIZE - buffer.size());
+				buffer.insert(buffer.end(), src, src + n);
+				src += n, size -= n;
+				if (buffer.size() == BUFFER_SIZE) {
+					// Written up to a block boundary, so the writes that follow are aligned even if this one isn't
+					size_t n = buffer.size() - end() % DIRECT_ALIGNMENT;
+					CHECK(out.write_at(buffer.data(), n, start) == n, "Failed to write output file");
+					buffer.erase(buffer.begin(), buffer.begin() + n), start += n;
+				}
+			}
+			position = end();
+		}
+		// Writes at `offset` without moving the cursor. i.e. tables patched once the data is in
+		void write_at(const void* data, size_t size, uint64_t offset) {
+			flush();
+			CHECK(out.write_at(data, size, offset) == size, "Failed to write output file");
+		}
+	};
+
+	struct range {
+		uint64_t offset;
+		uint64_t size;
+	};
+	// Issues reads of `ranges` in ascending offset order, regardless of the order they were given in.
+	// The kernel is told about the upcoming `window` bytes of ranges ahead of time, and the pages of
+	// consumed ranges are dropped so a sweep through a huge archive doesn't evict the rest of the page cache.
+	// Both are batched (half a window's worth at a time, nearby ranges advised together), so that
+	// archives of many small entries don't cost extra calls per entry.
+	struct read_schedule {
+	private:
+		file& fin;
+		std::vector<range> ranges;
+		std::vector<size_t> order;
+		size_t window, advised{ 0 };
+		uint64_t dropped{ 0 };
+	public:
+		read_schedule(file& fin, std::vector<range> const& ranges, size_t window = 64 << 20) : fin(fin), ranges(ranges), window(window) {
+			for (size_t i = 0; i < ranges.size(); i++) order.push_back(i);
+			std::stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) { return ranges[lhs].offset < ranges[rhs].offset; });
+			fin.advise(file::advice::SEQUENTIAL);
+		}
+		size_t size() const { return order.size(); }
+		// Index into the original `ranges` of the i-th scheduled read
+		size_t index(size_t i) const { return order[i]; }
+		// Reads the i-th scheduled range. Must be called with ascending `i`.
+		size_t read(size_t i, void* dst) {
+			range const& current = ranges[order[i]];
+			advised = std::max(advised, i);
+			if (advised < order.size() && ranges[order[advised]].offset <= current.offset + window / 2) {
+				// Ranges less than this apart are advised as one
+				constexpr uint64_t gap = 64 << 10;
+				uint64_t begin = 0, end = 0;
+				for (; advised < order.size(); advised++) {
+					range const& next = ranges[order[advised]];
+					if (next.offset > current.offset + window) break;
+					if (end && next.offset <= end + gap) end = std::max(end, next.offset + next.size);
+					else {
+						if (end) fin.advise(file::advice::WILLNEED, begin, end - begin);
+						begin = next.offset, end = next.offset + next.size;
+					}
+				}
+				if (end) fin.advise(file::advice::WILLNEED, begin, end - begin);
+			}
+			size_t size = fin.read_at(dst, current.size, current.offset);
+			// Only whole pages behind the read head are dropped. Ranges may overlap (i.e. deduplicated entries)
+			constexpr uint64_t page_size = 4096;
+			uint64_t consumed = (current.offset + current.size) & ~(page_size - 1);
+			if (i + 1 < order.size()) consumed = std::min(consumed, ranges[order[i + 1]].offset & ~(page_size - 1));
+			if (consumed >= dropped + window / 4 || (i + 1 == order.size() && consumed > dropped)) {
+				fin.advise(file::advice::DONTNEED, dropped, consumed - dropped);
+				dropped = consumed;
+			}
+			return size;
+		}
+	};
+
+	// `size` bytes at `offset` of `source`. i.e. the stored bytes of an entry in the archive being repacked
+	struct extent {
+		file* source{ nullptr };
+		uint64_t offset{ 0 }, size{ 0 };
+		explicit operator bool() const { return source != nullptr; }
+	};
+	// Total bytes shared through reflinks by append_extent
+	inline std::atomic<uint64_t>& cloned_bytes() {
+		static std::atomic<uint64_t> total = 0;
+		return total;
+	}
+	// Appends `src` to `out`, at its current position or up to `align` byte steps further, returning where it was put.
+	// Blocks of `src` are shared with a reflink (FICLONERANGE) when both ends line up modulo the filesystem's block size,
+	// hence the extra `align` steps. Everything else goes through copy_file_range, or plain reads and writes without it.
+	inline uint64_t append_extent(writer& out, extent const& src, uint64_t align = 0) {
+		uint64_t position = out.tell();
+		auto copy = [&](uint64_t from, uint64_t size) {
+#ifdef __linux__
+			out.flush();
+			loff_t in = src.offset + from, dst = position + from;
+			while (size) {
+				ssize_t n = copy_file_range(src.source->native_handle(), &in, out.target().native_handle(), &dst, size, 0);
+				if (n <= 0) break;
+				out.target().written(position + from + n);
+				from += n, size -= n;
+			}
+#endif
+			u8vec buffer(std::min<uint64_t>(size, 1 << 20));
+			out.seek(position + from);
+			while (size) {
+				size_t n = std::min<uint64_t>(size, buffer.size());
+				CHECK(src.source->read_at(buffer.data(), n, src.offset + from) == n, "Truncated reference archive");
+				out.write(buffer.data(), n);
+				from += n, size -= n;
+			}
+		};
+#ifdef __linux__
+		int fd = out.target().native_handle();
+		struct stat st {};
+		uint64_t block = fstat(fd, &st) == 0 && st.st_blksize ? st.st_blksize : 4096;
+		if (align && block % align == 0)
+			for (uint64_t step = 0; step < block / align && position % block != src.offset % block; step++) position += align;
+		if (position % block == src.offset % block) {
+			uint64_t head = std::min(src.size, (block - src.offset % block) % block);
+			uint64_t body = (src.size - head) / block * block;
+			file_clone_range range{ .src_fd = src.source->native_handle(), .src_offset = src.offset + head, .src_length = body, .dest_offset = position + head };
+			out.flush();
+			if (body && ioctl(fd, FICLONERANGE, &range) == 0) {
+				cloned_bytes() += body;
+				out.target().written(position + head + body);
+				copy(0, head);
+				copy(head + body, src.size - head - body);
+				out.seek(position + src.size);
+				return position;
+			}
+		}
+#endif
+		copy(0, src.size);
+		out.seek(position + src.size);
+		return position;
+	}
+}
@@ -0,0 +1,45 @@
+#include "synth.hpp"
+
+int main(int, char* argv[]) {
+	argh::parser cmdl(argv, argh::parser::Mode::PREFER_PARAM_FOR_UNREG_OPTION);
+
+	struct {
+		std::string output;
+		std::string tree;
+		synth::workload load;
+		bool compress;
+		size_t threads;
+	} args;
+
+	auto c_output = cmdl({ "o", "output" });
+	auto c_tree = cmdl({ "t", "tree" });
+	if (!(c_output || c_tree)) {
+		std::cerr << "Synthetic CPK/MPK archive generator\n";
+		std::cerr << "Note:\n";
+		std::cerr << "  - The format is chosen by the output's extension (.mpk for MPK, CPK (ITOC) otherwise).\n";
+		std::cerr << "  - Contents are deterministic for a given seed. Sizes are log-uniformly distributed.\n";
+		std::cerr << "Usage: " << argv[0] << " -o <output .cpk/.mpk> -n [count] --min-size [bytes] --max-size [bytes] --compressibility [0..1] --seed [seed] [--compress]\n";
+		std::cerr << "	- many tiny scripts: " << argv[0] << " -o script.mpk -n 20000 --min-size 256 --max-size 16K --compressibility 0.9\n";
+		std::cerr << "	- a few huge movies: " << argv[0] << " -o movie.cpk -n 4 --min-size 256M --max-size 1G --compressibility 0\n";
+		std::cerr << "	- unpacked tree:     " << argv[0] << " -t <outdir> --format [cpk/mpk] ...\n";
+		std::cerr << "	  Writes the files as they would be unpacked instead.\n";
+		std::cerr << "	  With --compress, CPK entries are CRILAYLA compressed.\n";
+		return EXIT_FAILURE;
+	}
+	if (c_output) std::getline(c_output, args.output);
+	if (c_tree) std::getline(c_tree, args.tree);
+	cmdl({ "n", "count" }, 1000) >> args.load.count;
+	args.load.min_size = parse_size(cmdl("min-size", "1K").str());
+	args.load.max_size = parse_size(cmdl("max-size", "64K").str());
+	cmdl("compressibility", 0.5) >> args.load.compressibility;
+	cmdl("seed", 0) >> args.load.seed;
+	cmdl({ "j", "threads" }, worker_pool::default_concurrency()) >> args.threads;
+	args.compress = cmdl["compress"];
+	std::string format = args.output.size() ? std::filesystem::path(args.output).extension().string() : cmdl("format", "cpk").str();
+	args.load.type = (format == ".mpk" || format == "mpk") ? archive::format::MPK : archive::format::CPK;
+
+	if (args.tree.size()) synth::write_tree(args.load, args.tree, args.threads);
+	else synth::write_archive(args.load, args.output, args.compress, args.threads);
+	std::cerr << args.load.count << " files, " << synth::total_size(args.load) << " bytes\n";
+	return EXIT_SUCCESS;
+}
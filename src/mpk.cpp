@@ -1,37 +1,12 @@
-namespace mpk {
-	constexpr uint32_t MPK_MAGIC = fourCC('M', 'P', 'K', '\0');
+#include "archive.hpp"
+#include "diff.hpp"
+#include "convert.hpp"
+#include "watch.hpp"
+#include "serve.hpp"
+#include "inventory.hpp"
+#include <set>
 
-	struct mpk_header {
-		uint32_t magic{};
-		uint32_t version{};
-		uint64_t entries{};
-		char padding[0x30]{};
-	};
-
-	struct mpk_entry {
-		uint32_t compression{}; // XXX: ignored for now
-		uint32_t entry_id{};
-		uint64_t offset{};
-		uint64_t size{};
-		uint64_t size_decompressed{};
-		char filename[0xE0]{};
-
-		// i.e. "0x1e_phone_rine.dds"
-		static const mpk_entry from_unpacked_filename(std::stringstream& ss) {
-			mpk_entry entry{};
-			CHECK(ss >> std::hex >> entry.entry_id);
-			CHECK(ss.ignore() >> entry.filename);
-			return entry;
-		}
-
-		const std::string to_unpacked_filename() const {
-			std::stringstream ss;
-			ss << "0x" << std::hex << entry_id << "_" << filename;
-			return ss.str();
-		}
-	};
-}
-int main(int argc, char* argv[])
+int main(int, char* argv[])
 {
 	argh::parser cmdl(argv, argh::parser::Mode::PREFER_PARAM_FOR_UNREG_OPTION);
 
@@ -39,91 +14,191 @@ int main(int argc, char* argv[])
 		std::string infile;
 		std::string outdir;
 		std::string repack;
+		std::string diff;
+		std::string convert;
+		std::string serve;
+		std::string list;
+		std::string tar;
+		std::string trace;
+		std::string reference;
+		std::string layout;
+		size_t threads;
+		size_t mem_limit;
 	} args;
 
 	auto c_outdir = cmdl({ "o", "outdir" });
 	auto c_infile = cmdl({ "i", "infile" });
 	auto c_repack = cmdl({ "r", "repack" });
-	if (!c_outdir || !(c_infile || c_repack)) {
+	auto c_diff = cmdl({ "d", "diff" });
+	auto c_convert = cmdl({ "c", "convert" });
+	auto c_serve = cmdl({ "s", "serve" });
+	auto c_list = cmdl({ "l", "list" });
+	bool f_list = c_list || cmdl[{ "l", "list" }];
+	auto c_tar = cmdl({ "t", "tar" });
+	bool f_tar = c_tar || cmdl[{ "t", "tar" }];
+	if (!((c_outdir || f_tar) && (c_infile || c_repack)) && !(c_infile && c_diff) && !(c_infile && c_convert) && !(c_infile && c_serve) && !(c_infile && f_list)) {
 		std::cerr << "MAGES. PacK - MPK Unpacker/Repacker\n";
 		std::cerr << "Tested against STEINS;GATE Steam & STEINS;GATE 0 Steam MPK files\n";
 		std::cerr << "Note:\n";
-		std::cerr << "  - The unpacked files are named by their IDs in hex, the followed by their file name (i.e. 0x1e_phone_rine.dds)\n";		
-		std::cerr << "Usage: " << argv[0] << " -o <outdir> -i [infile] -r [repack]\n";
-		std::cerr << "	- unpacking: " << argv[0] << " -o <outdir> -i <.mpk input file>\n";
+		std::cerr << "  - The unpacked files are named by their IDs in hex, the followed by their file name (i.e. 0x1e_phone_rine.dds)\n";
+		std::cerr << "  - Multiple inputs (or directories of them) can be unpacked at once. Each is then unpacked into <outdir>/<archive name>. CPK inputs are detected and unpacked as such.\n";
+		std::cerr << "Usage: " << argv[0] << " -o <outdir> -i [infile...] -r [repack] -j [threads] --mem-limit [bytes, i.e. 512M]\n";
+		std::cerr << "	- unpacking: " << argv[0] << " -o <outdir> -i <.mpk input file or directory> [more inputs...]\n";
+		std::cerr << "	  With --resume, an interrupted unpack into the same <outdir> only redoes the entries it didn't finish.\n";
+		std::cerr << "	  Finished files are only checked by size (and the last one by hash), so don't edit <outdir> in between.\n";
 		std::cerr << "	- repacking: " << argv[0] << " -o <outdir> -r <.mpk repacked output>\n";
+		std::cerr << "	  With --reference <original .mpk file>, files left unchanged from the original share its data (reflinks on btrfs/XFS) instead of being rewritten.\n";
+		std::cerr << "	  Byte-identical files are stored once. --no-dedup skips looking for them.\n";
+		std::cerr << "	  With --layout <access trace>, file data is laid out in the order of the trace (one ID or name per line), the rest following by ID.\n";
+		std::cerr << "	  With --watch, the tool keeps running after packing, patching files changed in <outdir> into the .mpk output as they're saved (Linux only).\n";
+		std::cerr << "	- streaming: " << argv[0] << " -t [.tar output] -i <.mpk input file or directory> [more inputs...]\n";
+		std::cerr << "	             " << argv[0] << " -t [.tar input] -r <.mpk repacked output>\n";
+		std::cerr << "	  Unpacked files are streamed as a tar archive instead of being written to <outdir>, and vice versa. Without a file name, stdout/stdin is used.\n";
+		std::cerr << "	- converting: " << argv[0] << " -i <.cpk or .mpk input file> -c <output file> [--format cpk/mpk] [--compress]\n";
+		std::cerr << "	  Converts between CPK and MPK archives without unpacking, the output format following its extension (mpk if unsure). CPK entries are named after their unpacked names in the MPK.\n";
+		std::cerr << "	  With --compress, entries are CRILAYLA compressed where it makes them smaller (CPK only).\n";
+		std::cerr << "	- listing: " << argv[0] << " -i <.mpk input file or directory> [more inputs...] -l [.jsonl output]\n";
+		std::cerr << "	  Lists every entry with its file type (told by magic, from its first 256 bytes only), sizes and compression ratio as JSON lines. Without a file name, stdout is used.\n";
+		std::cerr << "	- serving: " << argv[0] << " -i <.mpk input file or directory> [more inputs...] -s <socket path> [--cache-limit bytes, i.e. 256M]\n";
+		std::cerr << "	  Keeps the archives open and answers list/stat/read requests on a Unix domain socket. See serve.hpp for the protocol.\n";
+		std::cerr << "	- direct I/O: add --direct-io to unpacking or repacking to bypass the page cache (O_DIRECT) where the filesystem allows it.\n";
+		std::cerr << "	- huge pages: add --huge-pages to back large buffers with transparent huge pages.\n";
+		std::cerr << "	- index cache: add --index-cache to anything reading archives to keep their parsed TOC in a <archive>.mgi file next to them, reused while the archive is unchanged.\n";
+		std::cerr << "	- tracing: add --trace <.json output> to any of the above to record a Chrome/Perfetto timeline of the run.\n";
+		std::cerr << "	- comparing: " << argv[0] << " -i <old .mpk file> -d <new .mpk file> [-o <patch outdir>] [--by-name]\n";
+		std::cerr << "	  Lists added (+), removed (-) and changed (M) entries. Entries are matched by ID, or by file name for MPK files with --by-name (which rejects duplicate names).\n";
+		std::cerr << "	  With -o, the added and changed entries of the new file are unpacked into <patch outdir>.\n";
 		return EXIT_FAILURE;
 	}
 	if (c_outdir) std::getline(c_outdir, args.outdir);
 	if (c_infile) std::getline(c_infile, args.infile);
 	if (c_repack) std::getline(c_repack, args.repack);
+	if (c_diff) std::getline(c_diff, args.diff);
+	if (c_convert) std::getline(c_convert, args.convert);
+	if (c_serve) std::getline(c_serve, args.serve);
+	if (c_list) std::getline(c_list, args.list);
+	else if (f_list) args.list = "-";
+	if (cmdl("trace")) std::getline(cmdl("trace"), args.trace);
+	if (cmdl("reference")) std::getline(cmdl("reference"), args.reference);
+	if (cmdl("layout")) std::getline(cmdl("layout"), args.layout);
+	if (c_tar) std::getline(c_tar, args.tar);
+	else if (f_tar) args.tar = "-";
+	cmdl({ "j", "threads" }, worker_pool::default_concurrency()) >> args.threads;
+	args.mem_limit = parse_size(cmdl("mem-limit", "512M").str());
 
+	if (args.trace.size()) trace::enable();
+	io::direct_io() = cmdl["direct-io"];
+	pool::huge_pages() = cmdl["huge-pages"];
+	pool::depot_limit() = args.mem_limit / 8; // Freed buffers kept for reuse count against the limit too
+	archive::sidecar::enabled() = cmdl["index-cache"];
 	{
 		using namespace std::filesystem;
 		if (args.repack.size()) { /* packing */
-			std::vector<std::pair<mpk::mpk_entry, path>> entries;
-			size_t buffer_size = 0;
-			CHECK(exists(args.outdir) && is_directory(args.outdir), "Invalid input directory");
-			for (auto& path : directory_iterator(args.outdir)) {
-				std::stringstream ss(path.path().filename().string());
-				entries.push_back({ mpk::mpk_entry::from_unpacked_filename(ss),path });
-				buffer_size = std::max(buffer_size, file_size(path));
+			mpk::file_entries files;
+			std::unique_ptr<tar::spool> spool;
+			if (args.tar.size()) {
+				FILE* stream = tar::open_stream(args.tar, false);
+				CHECK(stream, "Failed to open input tar stream");
+				spool.reset(new tar::spool(stream));
+				for (auto& file : spool->entries) {
+					std::stringstream ss(path(file.name).filename().string());
+					mpk::file_entry entry{ mpk::mpk_entry::from_unpacked_filename(ss) };
+					entry.entry.size = file.size;
+					entry.source = [&spool = *spool, &file](uint8_t* dst) { spool.read(file, dst); };
+					files.push_back(entry);
+				}
+			}
+			else {
+				CHECK(exists(args.outdir) && is_directory(args.outdir), "Invalid input directory");
+				for (auto& path : directory_iterator(args.outdir)) {
+					std::stringstream ss(path.path().filename().string());
+					mpk::file_entry entry{ mpk::mpk_entry::from_unpacked_filename(ss), path.path().string() };
+					entry.entry.size = file_size(path);
+					files.push_back(entry);
+				}
+			}
+			{
+				// IDs come from the file names alone, so i.e. the same ID under two prefixed directories of a tar would collide
+				std::set<uint32_t> ids;
+				for (auto& file : files) CHECK(ids.insert(file.entry.entry_id).second, "Duplicate file ID " + std::to_string(file.entry.entry_id) + ": " + file.entry.filename);
 			}
-			std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {return a.first.entry_id < b.first.entry_id; });
-			// Sanity check : entry IDs must be unique and monotonically increasing
-			for (size_t i = 0; i < entries.size(); i++)
-				CHECK(entries[i].first.entry_id == i, "Invalid unpack source folder. Note that file IDs should be contagious and no extra files is present.");
-			u8vec buffer(buffer_size);
 			path output = path(args.repack);
 			if (output.has_parent_path() && !exists(output.parent_path()))
 				create_directories(output.parent_path());
-			FILE* fp = fopen(output.string().c_str(), "wb");
-			CHECK(fp, "Failed to open output file.");
-			
-			mpk::mpk_header hdr{};
-			hdr.magic = mpk::MPK_MAGIC;
-			hdr.version = 0x020000;
-			hdr.entries = entries.size();
-			fwrite(&hdr, sizeof(hdr), 1, fp);
-			fseek(fp, hdr.entries * sizeof(mpk::mpk_entry), SEEK_CUR);
-			fseek(fp, alignUp(ftell(fp), 2048), SEEK_SET);
-			for (auto& [entry, path] : entries) {
-				FILE* fp_in = fopen(path.string().c_str(), "rb");
-				entry.offset = ftell(fp);
-				entry.size_decompressed = entry.size = file_size(path);
-				fread(buffer.data(), 1, entry.size, fp_in);
-				fwrite(buffer.data(), 1, entry.size, fp);
-				fseek(fp, alignUp(ftell(fp), 2048), SEEK_SET);
-				fclose(fp_in);
+			std::vector<uint32_t> order;
+			archive::duplicates duplicates; // Holds the contents read while deduplicating until packed
+			{
+				std::vector<archive::repack_file> candidates;
+				for (auto& file : files) candidates.push_back({ file.entry.entry_id, file.entry.size, file.path, file.source });
+				if (!cmdl["no-dedup"]) {
+					duplicates = archive::duplicate_files(candidates, args.threads, args.mem_limit);
+					for (size_t i = 0; i < files.size(); i++) {
+						if (duplicates.of[i] != SIZE_MAX) files[i].duplicate_of = files[duplicates.of[i]].entry.entry_id;
+						else if (duplicates.contents[i].size()) files[i].contents = duplicates.contents[i];
+					}
+				}
+				if (args.layout.size()) order = archive::access_order(args.layout, candidates);
+			}
+			std::unique_ptr<io::file> reference;
+			if (args.reference.size()) {
+				archive::index original = archive::open(args.reference);
+				CHECK(original.type == archive::format::MPK, "Reference is not an MPK archive: " + args.reference);
+				std::vector<archive::repack_file> candidates;
+				for (auto& file : files) candidates.push_back({ file.entry.entry_id, file.entry.size, file.path, file.source });
+				auto matches = archive::unchanged_entries(original, candidates, args.threads);
+				reference.reset(new io::file(original.path));
+				for (size_t i = 0; i < files.size(); i++)
+					if (matches[i]) files[i].reference = { reference.get(), matches[i]->offset, matches[i]->size };
 			}
-			fseek(fp, sizeof(hdr), SEEK_SET);
-			for (auto& [entry, path] : entries) fwrite(&entry, sizeof(mpk::mpk_entry), 1, fp);
-			fclose(fp);
+			io::file fout(output, true);
+			CHECK(fout, "Failed to open output file.");
+			mpk::pack(fout, files, order);
+			fout.close();
+			if (reference) std::cerr << io::cloned_bytes() << " bytes shared with the reference through reflinks\n";
+			if (cmdl["watch"]) {
+				CHECK(args.tar.empty(), "--watch needs an input directory");
+				archive::watch(args.outdir, output, archive::format::MPK, false);
+			}
+		}
+		else if (args.diff.size()) { /* comparing */
+			archive::diff(args.infile, args.diff, args.outdir, cmdl["by-name"], args.threads, args.mem_limit);
+		}
+		else if (args.convert.size()) { /* converting */
+			std::string format = cmdl("format", path(args.convert).extension() == ".cpk" ? "cpk" : "mpk").str();
+			CHECK(format == "cpk" || format == "mpk", "Unknown output format: " + format);
+			archive::convert(args.infile, args.convert, format == "mpk" ? archive::format::MPK : archive::format::CPK, cmdl["compress"], args.threads, args.mem_limit);
+		}
+		else if (args.list.size()) { /* listing */
+			std::vector<std::string> inputs{ args.infile };
+			for (size_t i = 1; i < cmdl.pos_args().size(); i++) inputs.push_back(cmdl.pos_args()[i]);
+			FILE* output = args.list == "-" ? stdout : fopen(args.list.c_str(), "w");
+			CHECK(output, "Failed to open output file: " + args.list);
+			archive::inventory(inputs, output, args.threads);
+			if (output != stdout) fclose(output);
+		}
+		else if (args.serve.size()) { /* serving */
+			std::vector<std::string> inputs{ args.infile };
+			for (size_t i = 1; i < cmdl.pos_args().size(); i++) inputs.push_back(cmdl.pos_args()[i]);
+			archive::serve(inputs, args.serve, parse_size(cmdl("cache-limit", "256M").str()));
 		}
 		else { /* unpacking */
-			mpk::mpk_header hdr;
-
-			FILE* fp = fopen(args.infile.c_str(), "rb");
-			fread(&hdr, sizeof(hdr), 1, fp);    
-			CHECK(hdr.magic == mpk::MPK_MAGIC);
-
-			std::vector<mpk::mpk_entry> entries(hdr.entries);
-			fread(entries.data(), sizeof(mpk::mpk_entry), hdr.entries, fp);
-
-			u8vec buffer;
-			for (const auto& entry : entries) {
-				path output = path(args.outdir) / path(entry.to_unpacked_filename());
-				if (output.has_parent_path() && !exists(output.parent_path()))
-					create_directories(output.parent_path());
-				FILE* fp_out = fopen(output.string().c_str(), "wb");
-				fseek(fp, entry.offset, SEEK_SET);
-				buffer.resize(entry.size);
-				fread(buffer.data(), 1, entry.size, fp);
-				fwrite(buffer.data(), 1, entry.size, fp_out);
-				fclose(fp_out);
+			std::vector<std::string> inputs{ args.infile };
+			for (size_t i = 1; i < cmdl.pos_args().size(); i++) inputs.push_back(cmdl.pos_args()[i]);
+			if (args.tar.size()) {
+				FILE* stream = tar::open_stream(args.tar, true);
+				CHECK(stream, "Failed to open output tar stream");
+				archive::tar_sink sink(stream);
+				archive::unpack(inputs, sink, args.threads, args.mem_limit);
+				sink.finish();
+				if (stream != stdout) fclose(stream);
+			}
+			else {
+				archive::directory_sink sink(args.outdir, cmdl["resume"]);
+				archive::unpack(inputs, sink, args.threads, args.mem_limit);
+				sink.finish();
 			}
-			fclose(fp);
 		}
 	}
+	if (args.trace.size()) trace::write(args.trace);
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,111 @@
+#pragma once
+#include "pch.hpp"
+#include "trace.hpp"
+#include "io.hpp"
+namespace mpk {
+	constexpr uint32_t MPK_MAGIC = fourCC('M', 'P', 'K', '\0');
+
+	struct mpk_header {
+		uint32_t magic{};
+		uint32_t version{};
+		uint64_t entries{};
+		char padding[0x30]{};
+	};
+
+	struct mpk_entry {
+		uint32_t compression{}; // XXX: ignored for now
+		uint32_t entry_id{};
+		uint64_t offset{};
+		uint64_t size{};
+		uint64_t size_decompressed{};
+		char filename[0xE0]{};
+
+		// i.e. "0x1e_phone_rine.dds"
+		static const mpk_entry from_unpacked_filename(std::stringstream& ss) {
+			mpk_entry entry{};
+			CHECK(ss >> std::hex >> entry.entry_id);
+			CHECK(ss.ignore() >> entry.filename);
+			return entry;
+		}
+
+		const std::string to_unpacked_filename() const {
+			std::stringstream ss;
+			ss << "0x" << std::hex << entry_id << "_" << filename;
+			return ss.str();
+		}
+	};
+
+	// A file to be packed. Its contents are read from `path`, or taken from `contents` (which must stay valid
+	// until packed) or produced by `source` when set. Generated files can thus be packed without touching the disk.
+	// With `reference` set, identical bytes elsewhere are shared instead. See io::append_extent
+	// With `duplicate_of` set, the entry points at the stored copy of that (identical) entry instead.
+	struct file_entry {
+		mpk_entry entry;
+		std::string path;
+		std::span<const uint8_t> contents;
+		std::function<void(uint8_t* dst)> source;
+		io::extent reference;
+		std::optional<uint32_t> duplicate_of;
+	};
+	typedef std::vector<file_entry> file_entries;
+
+	// Packs `files` into `out`. Each entry's `size` must be set beforehand.
+	// The data is laid out in `order` (entry IDs, i.e. the order they're loaded in), followed by the rest by ID.
+	// The TOC is always sorted by ID.
+	inline void pack(io::file& out, file_entries& files, std::vector<uint32_t> const& order = {}) {
+		std::sort(files.begin(), files.end(), PRED(lhs.entry.entry_id < rhs.entry.entry_id));
+		// Sanity check : entry IDs must be unique and monotonically increasing
+		size_t buffer_size = 0;
+		for (size_t i = 0; i < files.size(); i++) {
+			CHECK(files[i].entry.entry_id == i, "Invalid unpack source folder. Note that file IDs should be contagious and no extra files is present.");
+			buffer_size = std::max(buffer_size, files[i].entry.size);
+		}
+		u8vec buffer(buffer_size);
+		std::vector<file_entry*> sequence;
+		std::vector<uint8_t> placed(files.size());
+		for (uint32_t id : order)
+			if (id < files.size() && !placed[id]) sequence.push_back(&files[id]), placed[id] = true;
+		for (size_t i = 0; i < files.size(); i++)
+			if (!placed[i]) sequence.push_back(&files[i]);
+
+		mpk_header hdr{};
+		hdr.magic = MPK_MAGIC;
+		hdr.version = 0x020000;
+		hdr.entries = files.size();
+		// The header and TOC are written last, once the offsets are known
+		io::writer fp(out, alignUp(sizeof(hdr) + hdr.entries * sizeof(mpk_entry), 2048));
+		for (auto file : sequence) {
+			auto& [entry, path, contents, source, reference, duplicate_of] = *file;
+			entry.size_decompressed = entry.size;
+			if (duplicate_of) continue;
+			if (reference) {
+				trace::scope _("clone", "entry", entry.filename);
+				entry.offset = io::append_extent(fp, reference, 2048);
+				fp.seek(alignUp(fp.tell(), 2048));
+				continue;
+			}
+			entry.offset = fp.tell();
+			const uint8_t* data = contents.data();
+			if (!data) {
+				trace::scope _("read", "entry", entry.filename);
+				if (source) source(buffer.data());
+				else {
+					io::file fin(path);
+					CHECK(fin, "Failed to open input file: " + path);
+					fin.read_at(buffer.data(), entry.size, 0);
+				}
+				data = buffer.data();
+			}
+			trace::scope _("write", "entry", entry.filename);
+			fp.write(data, entry.size);
+			fp.seek(alignUp(fp.tell(), 2048));
+		}
+		// Entries may share offsets. Every stored copy is known by now.
+		for (auto& file : files)
+			if (file.duplicate_of) file.entry.offset = files[*file.duplicate_of].entry.offset;
+		u8vec toc(sizeof(hdr));
+		memcpy(toc.data(), &hdr, sizeof(hdr));
+		for (auto& file : files) toc.insert(toc.end(), (uint8_t*)&file.entry, (uint8_t*)&file.entry + sizeof(mpk_entry));
+		fp.write_at(toc.data(), toc.size(), 0);
+	}
+}
@@ -9,7 +9,22 @@
 #include <source_location>
 #include <variant>
 #include <memory>
+#include <cstring>
+#include <map>
+#include <unordered_map>
+#include <sstream>
+#include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cinttypes>
 #include "argh.h"
+#include "pool.hpp"
 #define PRED(X) [](auto const& lhs, auto const& rhs) {return X;}
 #define PAIR2(T) std::pair<T,T>
 inline void __check(bool condition, const std::string& message = "", const std::source_location& location = std::source_location::current()) {
@@ -19,7 +34,7 @@ inline void __check(bool condition, const std::string& message = "", const std::
 		std::abort();
 	}
 }
-#define CHECK(EXPR, ...) __check(!!(EXPR), __VA_ARGS__)
+#define CHECK(EXPR, ...) __check(!!(EXPR), ##__VA_ARGS__)
 constexpr uint32_t fourCC(const char a, const char b, const char c, const char d) {
 	return (a << 0) | (b << 8) | (c << 16) | (d << 24);
 };
@@ -27,13 +42,23 @@ constexpr uint32_t fourCC(const char a, const char b, const char c, const char d
 constexpr size_t alignUp(size_t size, size_t alignment) {
 	return (size + alignment - 1) & ~(alignment - 1);
 }
+// Parses human readable sizes. i.e. "4096", "512K", "64M", "2G"
+inline size_t parse_size(std::string const& str) {
+	size_t pos = 0, size = std::stoull(str, &pos);
+	switch (pos < str.size() ? toupper(str[pos]) : 0) {
+	case 'G': size <<= 10; [[fallthrough]];
+	case 'M': size <<= 10; [[fallthrough]];
+	case 'K': size <<= 10; break;
+	}
+	return size;
+}
 inline void dump_memory(const char* fname, void* src, size_t size) {
 	FILE* f = fopen(fname, "wb");
 	fwrite(src, size, 1, f);
 	fclose(f);
 }
 template<typename T> concept Fundamental = std::is_fundamental_v<T>;
-typedef std::vector<uint8_t> u8vec;
+typedef pool::vector<uint8_t> u8vec; // NOTE: Pooled, and uninitialized on resize. See pool::allocator
 // Owning u8vec wrapper with stream operations
 // NOTE: Value parameters are type-sensitive.
 struct u8stream {
@@ -42,10 +67,10 @@ private:
 	bool big_endian;
 public:
 	u8vec buffer;
-	// Owning data. Initializes with a given size.
+	// Owning data. Initializes with a given size, leaving the contents uninitialized.
 	u8stream(size_t init_size, bool is_big_endian) : buffer(init_size), pos(0), big_endian(is_big_endian) {}
 	// Owning data. The source buffer is destroyed.
-	u8stream(u8vec&& buffer, bool is_big_endian) : buffer(buffer), pos(0), big_endian(is_big_endian) {}
+	u8stream(u8vec&& buffer, bool is_big_endian) : buffer(std::move(buffer)), pos(0), big_endian(is_big_endian) {}
 	// Non-owning (copying) stream. The data is copied and owned by the stream. The source buffer is not destroyed.
 	u8stream(u8vec const& buffer, bool is_big_endian) : buffer(buffer), pos(0), big_endian(is_big_endian) {}
 	inline u8vec::pointer data() { return buffer.data(); }
@@ -62,7 +87,7 @@ public:
 	}
 	inline void seek(size_t npos) {
 		pos = npos;
-		buffer.resize(std::max(buffer.size(), pos));
+		buffer.resize(std::max(buffer.size(), pos), 0);
 	}
 	inline size_t read_at(void* dst, size_t size, size_t offset, bool endianess = false) {
 		size_t size_read = std::min(size, buffer.size() - offset);
@@ -71,7 +96,7 @@ public:
 		return size_read;
 	}
 	inline size_t write_at(void* src, size_t size, size_t offset, bool endianess = false) {
-		buffer.resize(std::max(buffer.size(), offset + size));
+		buffer.resize(std::max(buffer.size(), offset + size), 0);
 		memcpy(buffer.data() + offset, src, size);
 		if (endianess && big_endian && size > 1) std::reverse((uint8_t*)buffer.data() + offset, (uint8_t*)buffer.data() + offset + size);
 		return size;
@@ -0,0 +1,105 @@
+#pragma once
+#include "pch.hpp"
+// Building blocks for staged (i.e. reader -> decoder -> writer) processing
+namespace pipeline {
+	// Bounded MPMC lock-free queue. Blocking operations park on the push/pop counters.
+	// See: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+	template<typename T> struct bounded_queue {
+	private:
+		struct cell {
+			std::atomic<size_t> sequence;
+			T data;
+		};
+		std::unique_ptr<cell[]> cells;
+		size_t mask;
+		alignas(64) std::atomic<size_t> enqueue_pos{ 0 };
+		alignas(64) std::atomic<size_t> dequeue_pos{ 0 };
+		alignas(64) std::atomic<uint32_t> pushes{ 0 };
+		alignas(64) std::atomic<uint32_t> pops{ 0 };
+	public:
+		// Capacity is rounded up to a power of 2
+		bounded_queue(size_t capacity) {
+			capacity = std::bit_ceil(std::max<size_t>(capacity, 2));
+			cells.reset(new cell[capacity]);
+			mask = capacity - 1;
+			for (size_t i = 0; i < capacity; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+		}
+		bool try_push(T& value) {
+			size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+			while (true) {
+				cell& slot = cells[pos & mask];
+				intptr_t diff = (intptr_t)slot.sequence.load(std::memory_order_acquire) - (intptr_t)pos;
+				if (diff == 0) {
+					if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						slot.data = std::move(value);
+						slot.sequence.store(pos + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) return false; // Full
+				else pos = enqueue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		bool try_pop(T& value) {
+			size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+			while (true) {
+				cell& slot = cells[pos & mask];
+				intptr_t diff = (intptr_t)slot.sequence.load(std::memory_order_acquire) - (intptr_t)(pos + 1);
+				if (diff == 0) {
+					if (dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						value = std::move(slot.data);
+						slot.sequence.store(pos + mask + 1, std::memory_order_release);
+						return true;
+					}
+				}
+				else if (diff < 0) return false; // Empty
+				else pos = dequeue_pos.load(std::memory_order_relaxed);
+			}
+		}
+		void push(T value) {
+			while (true) {
+				uint32_t seen = pops.load();
+				if (try_push(value)) break;
+				pops.wait(seen);
+			}
+			pushes.fetch_add(1), pushes.notify_all();
+		}
+		T pop() {
+			T value;
+			while (true) {
+				uint32_t seen = pushes.load();
+				if (try_pop(value)) break;
+				pushes.wait(seen);
+			}
+			pops.fetch_add(1), pops.notify_all();
+			return value;
+		}
+	};
+
+	// Caps the bytes held in flight across all stages
+	struct memory_budget {
+	private:
+		const size_t limit;
+		std::atomic<size_t> used{ 0 };
+	public:
+		memory_budget(size_t limit) : limit(limit) {}
+		// Blocks until `size` more bytes fit. A request larger than the whole budget
+		// is let through once nothing else is in flight, so it can't deadlock.
+		void acquire(size_t size) {
+			size_t current = used.load();
+			while (true) {
+				if (current == 0 || current + size <= limit) {
+					if (used.compare_exchange_weak(current, current + size)) return;
+				}
+				else {
+					used.wait(current);
+					current = used.load();
+				}
+			}
+		}
+		void release(size_t size) {
+			used.fetch_sub(size);
+			used.notify_all();
+		}
+	};
+}
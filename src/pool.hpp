@@ -0,0 +1,171 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <new>
+#include <bit>
+#include <cstdint>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+// Size classed buffer pool, backing u8vec
+// - Small blocks are rounded up to a power of two, from 64B to 1MB. Larger ones (i.e. whole entries) come
+//   straight from the system and go straight back, so they're never held past their use nor rounded up.
+// - Freed blocks go to a thread-local free list first, up to LOCAL_LIMIT bytes per thread. Overflowing lists
+//   spill into a shared depot of up to depot_limit() bytes, which is where threads that only ever allocate
+//   (i.e. the unpacking reader) get recycled blocks from. Set it from --mem-limit, which it counts against.
+// - Blocks of 4K and up are page aligned, so they can be used for O_DIRECT transfers as is.
+// - With huge_pages() set, blocks of 2MB and up are backed by transparent huge pages where available.
+namespace pool {
+	constexpr size_t MIN_CLASS = 6, MAX_CLASS = 20, CLASSES = MAX_CLASS - MIN_CLASS + 1;
+	constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+	// Bytes each thread keeps in total before blocks are spilled to the depot
+	constexpr size_t LOCAL_LIMIT = 2 << 20;
+	// Bytes the depot keeps before blocks are returned to the system
+	inline size_t& depot_limit() {
+		static size_t limit = 64 << 20;
+		return limit;
+	}
+
+	inline bool& huge_pages() {
+		static bool enabled = false;
+		return enabled;
+	}
+	inline size_t class_of(size_t size) {
+		return std::max<size_t>(std::bit_width(std::max<size_t>(size, 1) - 1), MIN_CLASS) - MIN_CLASS;
+	}
+	inline size_t class_size(size_t index) { return (size_t)1 << (index + MIN_CLASS); }
+	inline size_t alignment_of(size_t size) {
+		return size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : size >= 4096 ? 4096 : alignof(std::max_align_t);
+	}
+
+	// Blocks past the largest class are mapped and unmapped directly where possible. The C allocator would
+	// otherwise keep freed ones around (glibc raises its mmap threshold to the largest block freed).
+	constexpr size_t MAPPED_SIZE = (size_t)1 << MAX_CLASS;
+	inline size_t mapped_length(size_t size) { return (size + 4095) & ~(size_t)4095; }
+	inline void* system_allocate(size_t size) {
+#ifdef __linux__
+		if (size > MAPPED_SIZE) {
+			// Over-mapped by the alignment, then trimmed to it
+			size_t align = alignment_of(size), length = mapped_length(size), extra = align > 4096 ? align : 0;
+			uint8_t* base = (uint8_t*)mmap(nullptr, length + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (base == MAP_FAILED) throw std::bad_alloc();
+			uint8_t* block = (uint8_t*)(((uintptr_t)base + align - 1) & ~(uintptr_t)(align - 1));
+			if (block != base) munmap(base, block - base);
+			if (base + extra != block) munmap(block + length, base + extra - block);
+#ifdef MADV_HUGEPAGE
+			if (huge_pages() && size >= HUGE_PAGE_SIZE) madvise(block, length, MADV_HUGEPAGE);
+#endif
+			return block;
+		}
+#endif
+		void* block = ::operator new(size, std::align_val_t(alignment_of(size)));
+#ifdef MADV_HUGEPAGE
+		if (huge_pages() && size >= HUGE_PAGE_SIZE) madvise(block, size, MADV_HUGEPAGE);
+#endif
+		return block;
+	}
+	inline void system_free(void* block, size_t size) {
+#ifdef __linux__
+		if (size > MAPPED_SIZE) return (void)munmap(block, mapped_length(size));
+#endif
+		::operator delete(block, std::align_val_t(alignment_of(size)));
+	}
+
+	struct depot {
+		std::mutex lock;
+		std::vector<void*> blocks[CLASSES];
+		size_t bytes{ 0 };
+		// Never destroyed, so blocks can still be freed during static destruction
+		static depot& get() {
+			static depot* instance = new depot;
+			return *instance;
+		}
+	};
+
+	struct cache {
+		std::vector<void*> blocks[CLASSES];
+		size_t bytes{ 0 };
+		static inline thread_local bool destroyed = false;
+
+		// Returns nullptr once the calling thread's cache is gone (i.e. for thread_local buffers destroyed after it)
+		static cache* get() {
+			if (destroyed) return nullptr;
+			thread_local cache instance;
+			return &instance;
+		}
+		// Moves `count` blocks of a class to the depot. Whatever doesn't fit there is freed.
+		void spill(size_t index, size_t count) {
+			auto& local = blocks[index];
+			auto& shared = depot::get();
+			std::scoped_lock guard(shared.lock);
+			for (; count && local.size(); count--) {
+				void* block = local.back(); local.pop_back();
+				bytes -= class_size(index);
+				if (shared.bytes + class_size(index) <= depot_limit())
+					shared.blocks[index].push_back(block), shared.bytes += class_size(index);
+				else
+					system_free(block, class_size(index));
+			}
+		}
+		// Takes up to a quarter of the local limit's worth of blocks of a class from the depot
+		void refill(size_t index) {
+			auto& shared = depot::get();
+			std::scoped_lock guard(shared.lock);
+			size_t count = std::max<size_t>(LOCAL_LIMIT / class_size(index) / 4, 1);
+			for (; count && shared.blocks[index].size(); count--) {
+				blocks[index].push_back(shared.blocks[index].back()), shared.blocks[index].pop_back();
+				shared.bytes -= class_size(index), bytes += class_size(index);
+			}
+		}
+		// Spills half of every class, largest first, until the thread keeps at most half its limit
+		void trim() {
+			for (size_t i = CLASSES; i-- && bytes > LOCAL_LIMIT / 2;)
+				spill(i, (blocks[i].size() + 1) / 2);
+		}
+		~cache() {
+			for (size_t i = 0; i < CLASSES; i++) spill(i, blocks[i].size());
+			destroyed = true;
+		}
+	};
+
+	inline void* allocate(size_t size) {
+		size_t index = class_of(size);
+		if (index >= CLASSES) return system_allocate(size);
+		cache* local = cache::get();
+		if (local) {
+			auto& blocks = local->blocks[index];
+			if (blocks.empty()) local->refill(index);
+			if (blocks.size()) {
+				void* block = blocks.back();
+				blocks.pop_back();
+				local->bytes -= class_size(index);
+				return block;
+			}
+		}
+		return system_allocate(class_size(index));
+	}
+	inline void free(void* block, size_t size) {
+		if (!block) return;
+		size_t index = class_of(size);
+		if (index >= CLASSES) return system_free(block, size);
+		cache* local = cache::get();
+		if (!local) return system_free(block, class_size(index));
+		local->blocks[index].push_back(block), local->bytes += class_size(index);
+		if (local->bytes > LOCAL_LIMIT) local->trim();
+	}
+
+	// Pooled allocator. Elements are default-initialized, so resizing a vector of trivial types
+	// (i.e. before reading into it) leaves the new elements uninitialized instead of zeroing them.
+	// Use resize(n, 0) where zeroes are needed.
+	template<typename T> struct allocator {
+		typedef T value_type;
+		allocator() = default;
+		template<typename U> allocator(allocator<U> const&) {}
+		T* allocate(size_t n) { return (T*)pool::allocate(n * sizeof(T)); }
+		void deallocate(T* block, size_t n) { pool::free(block, n * sizeof(T)); }
+		template<typename U> void construct(U* ptr) { ::new((void*)ptr) U; }
+		template<typename U, typename... Args> void construct(U* ptr, Args&&... args) { ::new((void*)ptr) U(std::forward<Args>(args)...); }
+		template<typename U> bool operator==(allocator<U> const&) const { return true; }
+	};
+	template<typename T> using vector = std::vector<T, allocator<T>>;
+}
@@ -0,0 +1,238 @@
+#pragma once
+#include "archive.hpp"
+#include <list>
+#include <set>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#endif
+// Archive server over a local (Unix domain) socket. Archives are opened and indexed once, and
+// decompressed entries are kept in an LRU cache, so that tools don't pay for either per request.
+// Protocol: every request is a fixed size `request`, answered by a `response` header followed by
+// `length` bytes of payload. All integers are little-endian. Requests on a connection are answered
+// in order; connections are served concurrently.
+// - LIST_ARCHIVES: per archive, u32 entry count, u16 name length, name (file name of the archive)
+// - LIST:  per entry of `archive`, an entry record: u32 id, u64 size (unpacked), u64 stored size, u8 compressed, u16 name length, name
+// - STAT:  the entry record of `archive`'s `entry`th entry (in LIST order)
+// - READ:  up to `length` bytes of the unpacked contents of that entry, from `offset` on
+namespace archive {
+	namespace serve_protocol {
+		enum op : uint32_t { LIST_ARCHIVES = 0, LIST = 1, STAT = 2, READ = 3 };
+		enum status : int32_t { OK = 0, BAD_REQUEST = -1, NOT_FOUND = -2, IO_ERROR = -3 };
+		struct request {
+			uint32_t op;
+			uint32_t archive;
+			uint32_t entry;
+			uint32_t reserved;
+			uint64_t offset;
+			uint64_t length;
+		};
+		struct response {
+			int32_t status;
+			uint32_t reserved;
+			uint64_t length;
+		};
+	}
+
+	// Decompressed (CRILAYLA) entries, least recently used ones evicted past `limit` bytes.
+	// Entries that don't fit at all are decompressed per request instead.
+	struct entry_cache {
+		typedef std::shared_ptr<const u8vec> value;
+		typedef PAIR2(uint32_t) key; // archive, entry
+		size_t limit, used{ 0 };
+		std::mutex lock;
+		std::list<std::pair<key, value>> order; // Most recent first
+		std::map<key, decltype(order)::iterator> lookup;
+
+		entry_cache(size_t limit) : limit(limit) {}
+		value get(key const& k) {
+			std::scoped_lock guard(lock);
+			auto it = lookup.find(k);
+			if (it == lookup.end()) return nullptr;
+			order.splice(order.begin(), order, it->second);
+			return it->second->second;
+		}
+		void put(key const& k, value const& v) {
+			if (v->size() > limit) return;
+			std::scoped_lock guard(lock);
+			if (lookup.contains(k)) return; // Raced by another connection
+			order.emplace_front(k, v), lookup[k] = order.begin(), used += v->size();
+			while (used > limit) {
+				used -= order.back().second->size();
+				lookup.erase(order.back().first), order.pop_back();
+			}
+		}
+	};
+
+#ifndef _WIN32
+	// Self-pipe written by the SIGINT/SIGTERM handler, so the accept loop wakes up regardless of the thread the signal lands on
+	inline int serve_stop[2] = { -1, -1 };
+	inline void serve_stop_handler(int) {
+		int saved = errno;
+		(void)!write(serve_stop[1], "", 1);
+		errno = saved;
+	}
+#endif
+
+	// Serves `inputs` (archives, or directories of them) on the socket at `socket_path` until SIGINT/SIGTERM.
+	// Open connections are then shut down and waited for, and the socket is removed before returning
+	// (so that i.e. the trace can be written).
+	// NOTE: Not available on Windows
+	inline void serve(std::vector<std::string> const& inputs, std::filesystem::path const& socket_path, size_t cache_limit) {
+#ifndef _WIN32
+		using namespace serve_protocol;
+		std::vector<index> archives;
+		std::deque<io::file> files;
+		for (auto& path : collect_inputs(inputs)) {
+			archives.push_back(open(path));
+			CHECK(files.emplace_back().open(path), "Failed to open input file: " + path.string());
+		}
+		entry_cache cache(cache_limit);
+
+		auto append = [](u8vec& out, const void* data, size_t size) {
+			out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+		};
+		auto append_name = [&](u8vec& out, std::string const& name) {
+			uint16_t length = (uint16_t)std::min<size_t>(name.size(), UINT16_MAX);
+			append(out, &length, sizeof(length)), append(out, name.data(), length);
+		};
+		auto append_entry = [&](u8vec& out, entry const& entry) {
+			uint8_t compressed = entry.compressed;
+			append(out, &entry.id, sizeof(entry.id));
+			append(out, &entry.size_decompressed, sizeof(entry.size_decompressed));
+			append(out, &entry.size, sizeof(entry.size));
+			append(out, &compressed, sizeof(compressed));
+			append_name(out, entry.name);
+		};
+		auto send_all = [](int fd, const void* data, size_t size) {
+			for (size_t done = 0; done < size;) {
+				ssize_t n = ::send(fd, (const uint8_t*)data + done, size - done, MSG_NOSIGNAL);
+				if (n <= 0) return false;
+				done += n;
+			}
+			return true;
+		};
+		auto recv_all = [](int fd, void* data, size_t size) {
+			for (size_t done = 0; done < size;) {
+				ssize_t n = ::recv(fd, (uint8_t*)data + done, size - done, 0);
+				if (n <= 0) return false;
+				done += n;
+			}
+			return true;
+		};
+		// Fills `payload`, returning the status to answer with
+		auto handle = [&](request const& req, u8vec& payload) -> int32_t {
+			if (req.op == LIST_ARCHIVES) {
+				for (auto& archive : archives) {
+					uint32_t count = (uint32_t)archive.entries.size();
+					append(payload, &count, sizeof(count)), append_name(payload, archive.path.filename().string());
+				}
+				return OK;
+			}
+			if (req.op > READ) return BAD_REQUEST;
+			if (req.archive >= archives.size()) return NOT_FOUND;
+			auto& archive = archives[req.archive];
+			if (req.op == LIST) {
+				for (auto& entry : archive.entries) append_entry(payload, entry);
+				return OK;
+			}
+			if (req.entry >= archive.entries.size()) return NOT_FOUND;
+			auto& entry = archive.entries[req.entry];
+			if (req.op == STAT) {
+				append_entry(payload, entry);
+				return OK;
+			}
+			// READ
+			uint64_t size = entry.compressed ? entry.size_decompressed : entry.size;
+			if (req.offset >= size) return OK;
+			size_t length = std::min(req.length, size - req.offset);
+			payload.resize(length);
+			if (!entry.compressed) {
+				trace::scope _("read", "entry", entry.name);
+				return files[req.archive].read_at(payload.data(), length, entry.offset + req.offset) == length ? OK : IO_ERROR;
+			}
+			entry_cache::key key{ req.archive, req.entry };
+			entry_cache::value data = cache.get(key);
+			if (!data) {
+				trace::scope _("decompress", "entry", entry.name);
+				u8stream stored(entry.size, false);
+				if (files[req.archive].read_at(stored.data(), entry.size, entry.offset) != entry.size) return IO_ERROR;
+				u8vec header, body;
+				cpk::crilayla::decompress(stored, header, body);
+				body.insert(body.begin(), header.begin(), header.end());
+				if (body.size() != size) return IO_ERROR;
+				data = std::make_shared<const u8vec>(std::move(body));
+				cache.put(key, data);
+			}
+			memcpy(payload.data(), data->data() + req.offset, length);
+			return OK;
+		};
+
+		int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		CHECK(server >= 0, "Failed to create socket");
+		sockaddr_un address{ .sun_family = AF_UNIX };
+		CHECK(socket_path.string().size() < sizeof(address.sun_path), "Socket path too long: " + socket_path.string());
+		strcpy(address.sun_path, socket_path.string().c_str());
+		unlink(address.sun_path);
+		CHECK(bind(server, (sockaddr*)&address, sizeof(address)) == 0, "Failed to bind socket: " + socket_path.string());
+		CHECK(listen(server, SOMAXCONN) == 0, "Failed to listen on socket: " + socket_path.string());
+		size_t total = 0;
+		for (auto& archive : archives) total += archive.entries.size();
+		fprintf(stderr, "serve: %zu archives, %zu entries on %s\n", archives.size(), total, socket_path.string().c_str());
+		CHECK(pipe(serve_stop) == 0, "Failed to create pipe");
+		struct sigaction action {}, previous[2];
+		action.sa_handler = serve_stop_handler;
+		sigaction(SIGINT, &action, &previous[0]), sigaction(SIGTERM, &action, &previous[1]);
+		std::mutex lock;
+		std::condition_variable finished;
+		std::set<int> clients;
+		while (true) {
+			pollfd fds[2] = { { server, POLLIN, 0 }, { serve_stop[0], POLLIN, 0 } };
+			if (poll(fds, 2, -1) < 0) {
+				CHECK(errno == EINTR, "Failed to poll socket");
+				continue;
+			}
+			if (fds[1].revents) break;
+			int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0) {
+				CHECK(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN, "Failed to accept connection");
+				continue;
+			}
+			{
+				std::scoped_lock guard(lock);
+				clients.insert(client);
+			}
+			// One thread per connection. The index is read-only, and the cache is locked.
+			std::thread([&, client] {
+				trace::set_thread_name("connection");
+				request req;
+				u8vec payload;
+				while (recv_all(client, &req, sizeof(req))) {
+					payload.clear();
+					int32_t status = handle(req, payload);
+					if (status != OK) payload.clear();
+					response res{ .status = status, .length = payload.size() };
+					if (!send_all(client, &res, sizeof(res)) || !send_all(client, payload.data(), payload.size())) break;
+				}
+				std::scoped_lock guard(lock);
+				close(client), clients.erase(client);
+				finished.notify_all();
+			}).detach();
+		}
+		{
+			// Unblocks connections waiting on their clients. Requests being answered finish first.
+			std::unique_lock guard(lock);
+			for (int client : clients) shutdown(client, SHUT_RDWR);
+			finished.wait(guard, [&] { return clients.empty(); });
+		}
+		sigaction(SIGINT, &previous[0], nullptr), sigaction(SIGTERM, &previous[1], nullptr);
+		close(serve_stop[0]), close(serve_stop[1]), close(server);
+		unlink(address.sun_path);
+		fprintf(stderr, "serve: stopped\n");
+#else
+		CHECK(false, "Serving is not supported on Windows");
+#endif
+	}
+}
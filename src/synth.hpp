@@ -0,0 +1,137 @@
+#pragma once
+#include "archive.hpp"
+// Deterministic synthetic archive contents. Every entry's size and bytes derive from
+// (seed, index) alone, so contents can be regenerated for verification instead of stored.
+namespace synth {
+	struct workload {
+		archive::format type{ archive::format::CPK };
+		size_t count{ 1000 };
+		// Sizes are log-uniformly distributed in [min_size, max_size]
+		uint64_t min_size{ 1 << 10 }, max_size{ 64 << 10 };
+		// 0 yields random bytes, 1 yields highly repetitive script-like text
+		double compressibility{ 0.5 };
+		uint64_t seed{ 0 };
+	};
+
+	// splitmix64
+	struct rng {
+		uint64_t state;
+		rng(uint64_t seed) : state(seed) {}
+		uint64_t next() {
+			uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			return z ^ (z >> 31);
+		}
+		double uniform() { return (next() >> 11) * (1.0 / (1ULL << 53)); }
+	};
+	inline rng entry_rng(workload const& load, size_t index) { return rng(load.seed * 0x100000001B3ULL ^ (index + 1)); }
+
+	inline uint64_t entry_size(workload const& load, size_t index) {
+		rng gen = entry_rng(load, index);
+		double lo = std::log((double)std::max<uint64_t>(load.min_size, 1)), hi = std::log((double)std::max(load.max_size, load.min_size) + 1);
+		return std::min(std::max(load.min_size, (uint64_t)std::exp(lo + (hi - lo) * gen.uniform())), std::max(load.max_size, load.min_size));
+	}
+
+	// Named as the tools would unpack the entry
+	inline std::string entry_name(workload const& load, size_t index) {
+		if (load.type == archive::format::MPK) {
+			mpk::mpk_entry entry{};
+			entry.entry_id = (uint32_t)index;
+			snprintf(entry.filename, sizeof(entry.filename), "synth_%zu.bin", index);
+			return entry.to_unpacked_filename();
+		}
+		return std::to_string(index);
+	}
+
+	inline void fill(workload const& load, size_t index, uint8_t* dst, uint64_t size) {
+		static const char* words[] = { "El Psy Kongroo. ", "#Message(0x1e) ", "Okabe Rintaro ", "phone_rine.dds ", "\tbgm_play 12;\r\n", "Steins;Gate ", "Chaos;Head " };
+		rng gen = entry_rng(load, index);
+		gen.next(); // Used by entry_size
+		for (uint64_t pos = 0; pos < size;) {
+			if (gen.uniform() < load.compressibility) {
+				const char* word = words[gen.next() % std::size(words)];
+				size_t length = std::min<uint64_t>(strlen(word), size - pos);
+				memcpy(dst + pos, word, length), pos += length;
+			}
+			else {
+				uint64_t value = gen.next();
+				size_t length = std::min<uint64_t>(sizeof(value), size - pos);
+				memcpy(dst + pos, &value, length), pos += length;
+			}
+		}
+	}
+
+	inline uint64_t total_size(workload const& load) {
+		uint64_t total = 0;
+		for (size_t i = 0; i < load.count; i++) total += entry_size(load, i);
+		return total;
+	}
+
+	// Writes the workload out as an unpacked directory
+	inline void write_tree(workload const& load, std::filesystem::path const& outdir, size_t threads) {
+		std::filesystem::create_directories(outdir);
+		worker_pool pool(threads);
+		for (size_t i = 0; i < load.count; i++)
+			pool.submit([&, i] {
+				u8vec buffer(entry_size(load, i));
+				fill(load, i, buffer.data(), buffer.size());
+				io::file fout(outdir / entry_name(load, i), true);
+				CHECK(fout, "Failed to open output file");
+				fout.write_at(buffer.data(), buffer.size(), 0);
+			});
+	}
+
+	// Packs the workload straight into an archive. `compress` applies to CPK only, and runs on `threads` workers.
+	inline void write_archive(workload const& load, std::filesystem::path const& output, bool compress, size_t threads = 1) {
+		if (output.has_parent_path()) std::filesystem::create_directories(output.parent_path());
+		io::file fout(output, true);
+		CHECK(fout, "Failed to open output file: " + output.string());
+		if (load.type == archive::format::MPK) {
+			mpk::file_entries files(load.count);
+			for (size_t i = 0; i < load.count; i++) {
+				std::stringstream ss(entry_name(load, i));
+				files[i].entry = mpk::mpk_entry::from_unpacked_filename(ss);
+				files[i].entry.size = entry_size(load, i);
+				files[i].source = [&, i](uint8_t* dst) { fill(load, i, dst, entry_size(load, i)); };
+			}
+			mpk::pack(fout, files);
+		}
+		else {
+			CHECK(load.count <= 0x10000, "ITOC IDs are 16 bits wide");
+			package::file_entries files;
+			for (size_t i = 0; i < load.count; i++)
+				files.push_back(package::file_entry{
+					.id = (uint16_t)i,
+					.size = entry_size(load, i),
+					.path = entry_name(load, i),
+					.source = [&, i](uint8_t* dst) { fill(load, i, dst, entry_size(load, i)); }
+					});
+			package::ITOC itoc;
+			itoc.compress = compress, itoc.threads = threads;
+			itoc.pack(fout, files);
+		}
+	}
+
+	// Checks a directory against the workload. Returns the number of mismatched, missing or extra files.
+	inline size_t verify_tree(workload const& load, std::filesystem::path const& outdir, size_t threads) {
+		std::atomic<size_t> mismatches = 0;
+		{
+			worker_pool pool(threads);
+			for (size_t i = 0; i < load.count; i++)
+				pool.submit([&, i] {
+					std::filesystem::path path = outdir / entry_name(load, i);
+					std::error_code ec;
+					uint64_t size = entry_size(load, i);
+					if (std::filesystem::file_size(path, ec) != size || ec) { mismatches++; return; }
+					u8vec expected(size), actual(size);
+					fill(load, i, expected.data(), size);
+					io::file fin(path);
+					if (!fin || fin.read_at(actual.data(), size, 0) != size || expected != actual) mismatches++;
+				});
+		}
+		size_t files = 0;
+		for (auto& file : std::filesystem::directory_iterator(outdir)) files += file.is_regular_file();
+		return mismatches + (files > load.count ? files - load.count : 0);
+	}
+}
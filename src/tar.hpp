@@ -0,0 +1,220 @@
+#pragma once
+#include "pch.hpp"
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+// Minimal ustar reader/writer. Long names use GNU ././@LongLink records.
+// See: https://www.gnu.org/software/tar/manual/html_node/Standard.html
+namespace tar {
+	constexpr size_t RECORD_SIZE = 512; // Headers and contents are padded to this
+
+	struct header {
+		char name[100];
+		char mode[8];
+		char uid[8];
+		char gid[8];
+		char size[12];
+		char mtime[12];
+		char chksum[8];
+		char typeflag;
+		char linkname[100];
+		char magic[6];
+		char version[2];
+		char uname[32];
+		char gname[32];
+		char devmajor[8];
+		char devminor[8];
+		char prefix[155];
+		char padding[12];
+
+		void set_checksum() {
+			memset(chksum, ' ', sizeof(chksum));
+			uint32_t sum = 0;
+			for (size_t i = 0; i < sizeof(header); i++) sum += ((uint8_t*)this)[i];
+			snprintf(chksum, sizeof(chksum), "%06o", sum);
+			chksum[7] = ' ';
+		}
+		void set_size(uint64_t value) {
+			if (value < 077777777777ULL) snprintf(size, sizeof(size), "%011llo", (unsigned long long)value);
+			else { // Base-256 for sizes of 8GB and up
+				size[0] = (char)0x80;
+				for (int i = sizeof(size) - 1; i > 0; i--, value >>= 8) size[i] = value & 0xFF;
+			}
+		}
+		uint64_t get_size() const {
+			uint64_t value = 0;
+			if (size[0] & 0x80) {
+				for (size_t i = 1; i < sizeof(size); i++) value = (value << 8) | (uint8_t)size[i];
+				return value;
+			}
+			for (size_t i = 0; i < sizeof(size) && size[i] >= '0' && size[i] <= '7'; i++) value = (value << 3) | (size[i] - '0');
+			return value;
+		}
+	};
+	static_assert(sizeof(header) == RECORD_SIZE);
+
+	// Opens `path` for streaming. "-" refers to stdin/stdout.
+	inline FILE* open_stream(std::string const& path, bool write) {
+		if (path == "-") {
+#ifdef _WIN32
+			_setmode(_fileno(write ? stdout : stdin), _O_BINARY);
+#endif
+			return write ? stdout : stdin;
+		}
+		return fopen(path.c_str(), write ? "wb" : "rb");
+	}
+
+	struct writer {
+	private:
+		FILE* fp;
+		uint64_t pending{ 0 }, current{ 0 };
+		void write_header(std::string const& name, uint64_t size, char type) {
+			header hdr{};
+			memcpy(hdr.name, name.c_str(), std::min(name.size(), sizeof(hdr.name)));
+			strcpy(hdr.mode, "0000644");
+			strcpy(hdr.uid, "0000000");
+			strcpy(hdr.gid, "0000000");
+			strcpy(hdr.mtime, "00000000000");
+			hdr.set_size(size);
+			hdr.typeflag = type;
+			memcpy(hdr.magic, "ustar", 6);
+			memcpy(hdr.version, "00", 2);
+			hdr.set_checksum();
+			fwrite(&hdr, sizeof(hdr), 1, fp);
+		}
+		void pad(uint64_t size) {
+			static const uint8_t zeros[RECORD_SIZE]{};
+			fwrite(zeros, 1, alignUp(size, RECORD_SIZE) - size, fp);
+		}
+	public:
+		writer(FILE* fp) : fp(fp) {}
+		// Starts a regular file of `size` bytes. Its contents are then written with `write`.
+		void begin(std::string const& name, uint64_t size) {
+			CHECK(!pending, "Previous tar entry is incomplete");
+			if (name.size() > sizeof(header::name)) {
+				write_header("././@LongLink", name.size() + 1, 'L');
+				fwrite(name.c_str(), 1, name.size() + 1, fp);
+				pad(name.size() + 1);
+			}
+			write_header(name, size, '0');
+			pending = current = size;
+		}
+		void write(const void* data, size_t size) {
+			CHECK(size <= pending, "Tar entry overflow");
+			fwrite(data, 1, size, fp);
+			pending -= size;
+			if (!pending) pad(current);
+		}
+		// Writes the end-of-archive marker
+		void finish() {
+			static const uint8_t zeros[RECORD_SIZE * 2]{};
+			fwrite(zeros, 1, sizeof(zeros), fp);
+			fflush(fp);
+		}
+	};
+
+	struct reader {
+		struct entry {
+			std::string name;
+			uint64_t size;
+		};
+	private:
+		FILE* fp;
+		uint64_t remain{ 0 }, padding{ 0 };
+		void skip(uint64_t size) {
+			uint8_t buffer[RECORD_SIZE];
+			while (size) {
+				size_t read = fread(buffer, 1, std::min<uint64_t>(size, sizeof(buffer)), fp);
+				CHECK(read, "Truncated tar stream");
+				size -= read;
+			}
+		}
+		std::string read_string(uint64_t size) {
+			std::string str(size, '\0');
+			CHECK(fread(str.data(), 1, size, fp) == size, "Truncated tar stream");
+			skip(alignUp(size, RECORD_SIZE) - size);
+			return str.c_str();
+		}
+	public:
+		reader(FILE* fp) : fp(fp) {}
+		// Advances to the next regular file, skipping the unread remainder of the current one.
+		// Returns false at the end of the archive.
+		bool next(entry& entry) {
+			skip(remain + padding), remain = padding = 0;
+			std::string long_name;
+			header hdr;
+			while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+				if (!hdr.name[0]) return false; // End-of-archive marker
+				uint64_t size = hdr.get_size();
+				switch (hdr.typeflag) {
+				case 'L': /* GNU long name */
+					long_name = read_string(size);
+					continue;
+				case 'x': /* pax extended header. Only the path is used */ {
+					std::stringstream records(read_string(size));
+					std::string record;
+					while (std::getline(records, record))
+						if (auto pos = record.find(" path="); pos != std::string::npos) long_name = record.substr(pos + 6);
+					continue;
+				}
+				case '0': case '\0': case '7': /* Regular file */
+					if (long_name.size()) entry.name = long_name;
+					else if (hdr.prefix[0]) entry.name = std::string(hdr.prefix, strnlen(hdr.prefix, sizeof(hdr.prefix))) + "/" + std::string(hdr.name, strnlen(hdr.name, sizeof(hdr.name)));
+					else entry.name = std::string(hdr.name, strnlen(hdr.name, sizeof(hdr.name)));
+					entry.size = remain = size;
+					padding = alignUp(size, RECORD_SIZE) - size;
+					return true;
+				default: /* Directories, links, etc */
+					skip(alignUp(size, RECORD_SIZE));
+					long_name.clear();
+				}
+			}
+			return false;
+		}
+		size_t read(void* dst, size_t size) {
+			size = fread(dst, 1, std::min<uint64_t>(size, remain), fp);
+			remain -= size;
+			return size;
+		}
+	};
+
+	// Spools the regular files of a tar stream into an anonymous temporary file. The packers need every
+	// entry's size before writing any content, which a (non-seekable) stream can't provide upfront.
+	struct spool {
+		struct entry {
+			std::string name;
+			uint64_t offset;
+			uint64_t size;
+		};
+		std::vector<entry> entries;
+	private:
+		FILE* fp;
+		std::mutex lock;
+	public:
+		spool(FILE* stream) : fp(std::tmpfile()) {
+			CHECK(fp, "Failed to create spool file");
+			reader tar(stream);
+			reader::entry file;
+			u8vec buffer(1 << 20);
+			uint64_t offset = 0;
+			while (tar.next(file)) {
+				entries.push_back({ file.name, offset, file.size });
+				while (size_t size = tar.read(buffer.data(), buffer.size()))
+					fwrite(buffer.data(), 1, size, fp), offset += size;
+				CHECK(offset == entries.back().offset + file.size, "Truncated tar stream");
+			}
+		}
+		spool(spool const&) = delete;
+		~spool() { fclose(fp); }
+		void read(entry const& file, uint8_t* dst) {
+			std::scoped_lock guard(lock);
+#ifdef _WIN32
+			_fseeki64(fp, file.offset, SEEK_SET);
+#else
+			fseeko(fp, file.offset, SEEK_SET);
+#endif
+			CHECK(fread(dst, 1, file.size, fp) == file.size, "Failed to read spool file");
+		}
+	};
+}
@@ -0,0 +1,99 @@
+#pragma once
+#include "pch.hpp"
+#include <chrono>
+// Chrome/Perfetto trace-event timeline recorder
+// See: https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+// Events are appended to a buffer owned by the recording thread, so recording never takes a lock.
+// Buffers are only read back by `write`, once every recording thread is done.
+namespace trace {
+	struct event {
+		const char* name;
+		const char* category;
+		char detail[64];
+		int64_t begin, end; // ns since `enable`
+	};
+	struct thread_buffer {
+		uint32_t tid;
+		std::string name;
+		std::deque<event> events;
+	};
+	struct recorder {
+		bool enabled{ false };
+		std::chrono::steady_clock::time_point epoch;
+		std::mutex lock; // Guards `threads` only. Taken once per thread.
+		std::deque<thread_buffer> threads;
+
+		static recorder& get() {
+			static recorder instance;
+			return instance;
+		}
+		thread_buffer& local() {
+			thread_local thread_buffer* buffer = nullptr;
+			if (!buffer) {
+				std::scoped_lock guard(lock);
+				buffer = &threads.emplace_back();
+				buffer->tid = (uint32_t)threads.size();
+			}
+			return *buffer;
+		}
+		int64_t now() const { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count(); }
+	};
+
+	inline bool enabled() { return recorder::get().enabled; }
+	// Must be called before any thread starts recording
+	inline void enable() {
+		recorder::get().epoch = std::chrono::steady_clock::now();
+		recorder::get().enabled = true;
+	}
+	inline void set_thread_name(std::string const& name) {
+		if (enabled()) recorder::get().local().name = name;
+	}
+
+	// Records a complete event spanning the lifetime of the scope
+	struct scope {
+	private:
+		event* current{ nullptr };
+	public:
+		scope(const char* name, const char* category = "phase", std::string_view detail = {}) {
+			if (!enabled()) return;
+			current = &recorder::get().local().events.emplace_back();
+			current->name = name, current->category = category;
+			size_t size = std::min(detail.size(), sizeof(current->detail) - 1);
+			memcpy(current->detail, detail.data(), size), current->detail[size] = 0;
+			current->begin = recorder::get().now();
+		}
+		scope(scope const&) = delete;
+		~scope() { if (current) current->end = recorder::get().now(); }
+	};
+
+	inline std::string escape(std::string_view str) {
+		std::string out;
+		for (char c : str) {
+			if (c == '"' || c == '\\') out += '\\', out += c;
+			else if ((uint8_t)c < 0x20) {
+				char code[8]; snprintf(code, sizeof(code), "\\u%04x", c);
+				out += code;
+			}
+			else out += c;
+		}
+		return out;
+	}
+	inline void write(std::filesystem::path const& path) {
+		FILE* fp = fopen(path.string().c_str(), "w");
+		CHECK(fp, "Failed to open trace file: " + path.string());
+		fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		const char* separator = "";
+		for (auto& thread : recorder::get().threads) {
+			if (thread.name.size())
+				fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", separator, thread.tid, escape(thread.name).c_str()), separator = ",\n";
+			for (auto& event : thread.events) {
+				fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u", separator, event.name, event.category, event.begin / 1e3, (event.end - event.begin) / 1e3, thread.tid);
+				if (event.detail[0]) fprintf(fp, ",\"args\":{\"entry\":\"%s\"}", escape(event.detail).c_str());
+				fprintf(fp, "}");
+				separator = ",\n";
+			}
+		}
+		fprintf(fp, "\n]}\n");
+		fclose(fp);
+	}
+}
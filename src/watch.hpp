@@ -0,0 +1,246 @@
+#pragma once
+#include "archive.hpp"
+#include <set>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+// Incremental repacking of an unpacked directory, as its files change
+namespace archive {
+	struct watcher {
+		struct slot {
+			uint32_t id;
+			uint64_t offset, size, size_decompressed;
+		};
+		std::filesystem::path directory, output;
+		format type;
+		bool compress;
+		std::map<std::string, slot> slots; // By unpacked file name. CPK entries are named by their IDs, as when repacking.
+
+		watcher(std::filesystem::path const& directory, std::filesystem::path const& output, format type, bool compress)
+			: directory(directory), output(output), type(type), compress(compress) { reload(); }
+
+		// Unpacked names that can be repacked. Anything else (i.e. editor swap files) is ignored.
+		bool valid_name(std::string const& name) const {
+			if (type == format::CPK)
+				return name.size() && name.size() <= 5 && std::all_of(name.begin(), name.end(), ::isdigit) && std::stoul(name) <= 0xFFFF;
+			size_t separator = name.find('_');
+			return name.starts_with("0x") && separator > 2 && separator != std::string::npos && separator + 1 < name.size() && name.size() - separator - 1 < sizeof(mpk::mpk_entry::filename)
+				&& std::all_of(name.begin() + 2, name.begin() + separator, ::isxdigit) && name.find_first_of(" \t") == std::string::npos;
+		}
+		uint32_t id_of(std::string const& name) const {
+			std::stringstream ss(name);
+			if (type == format::CPK) { uint32_t id; ss >> id; return id; }
+			return mpk::mpk_entry::from_unpacked_filename(ss).entry_id;
+		}
+		void reload() {
+			index current = open(output);
+			CHECK(current.type == type, "Output archive changed format: " + output.string());
+			slots.clear();
+			for (auto& entry : current.entries)
+				slots[type == format::CPK ? std::to_string(entry.id) : entry.name] = { entry.id, entry.offset, entry.size, entry.size_decompressed };
+		}
+
+		// Stored form of an unpacked file. CRILAYLA compressed with `compress` where it makes it smaller (CPK only).
+		u8vec stored(std::string const& name) {
+			std::filesystem::path path = directory / name;
+			u8vec data(std::filesystem::file_size(path));
+			io::file fin(path);
+			CHECK(fin && fin.read_at(data.data(), data.size(), 0) == data.size(), "Failed to read input file: " + path.string());
+			if (compress && type == format::CPK) {
+				trace::scope _("compress", "entry", name);
+				u8vec compressed = cpk::crilayla::compress(data);
+				if (compressed.size() && compressed.size() < data.size()) return compressed;
+			}
+			return data;
+		}
+
+		// Rewrites the whole archive into a temporary file, then moves it over the output.
+		// Entries not in `dirty` are copied over from the current archive as stored.
+		void rebuild(std::set<std::string> const& dirty) {
+			using namespace std::filesystem;
+			std::vector<std::string> names;
+			for (auto& file : directory_iterator(directory))
+				if (file.is_regular_file() && valid_name(file.path().filename().string())) names.push_back(file.path().filename().string());
+			path temp = output; temp += ".tmp";
+			io::file fin(output);
+			CHECK(fin, "Failed to open output file: " + output.string());
+			io::file fout(temp, true);
+			CHECK(fout, "Failed to open output file: " + temp.string());
+			auto reference = [&](std::string const& name) -> io::extent {
+				auto it = slots.find(name);
+				if (dirty.contains(name) || it == slots.end()) return {};
+				return { &fin, it->second.offset, it->second.size };
+			};
+			if (type == format::MPK) {
+				mpk::file_entries files;
+				for (auto& name : names) {
+					std::stringstream ss(name);
+					mpk::file_entry file{ mpk::mpk_entry::from_unpacked_filename(ss), (directory / name).string() };
+					file.entry.size = file_size(directory / name);
+					file.reference = reference(name);
+					files.push_back(file);
+				}
+				mpk::pack(fout, files);
+			}
+			else {
+				package::ITOC itoc;
+				itoc.compress = compress;
+				package::file_entries files;
+				for (auto& name : names)
+					files.push_back(package::file_entry{
+						.id = (uint16_t)id_of(name),
+						.size = static_cast<uint32_t>(file_size(directory / name)),
+						.path = (directory / name).string(),
+						.reference = reference(name)
+						});
+				itoc.pack(fout, files);
+			}
+			fout.close(), fin.close();
+			rename(temp, output);
+			reload();
+		}
+
+		// Patches `name` into the MPK in place if it still fits before the next entry, or appends it otherwise.
+		// Stored copies shared with other (duplicate) entries are left alone.
+		bool patch_mpk(io::file& fp, std::string const& name, u8vec const& data) {
+			auto& target = slots[name];
+			uint64_t next = UINT64_MAX, end = 0;
+			bool shared = false;
+			for (auto& [_, slot] : slots) {
+				if (slot.offset > target.offset) next = std::min(next, slot.offset);
+				shared |= &slot != &target && slot.offset == target.offset;
+				end = std::max(end, slot.offset + slot.size);
+			}
+			bool in_place = !shared && target.offset + data.size() <= next;
+			if (!in_place) target.offset = alignUp(end, 2048);
+			CHECK(fp.write_at(data.data(), data.size(), target.offset) == data.size(), "Failed to write output file");
+			target.size = target.size_decompressed = data.size();
+			mpk::mpk_entry entry;
+			uint64_t toc = sizeof(mpk::mpk_header) + target.id * sizeof(mpk::mpk_entry);
+			CHECK(fp.read_at(&entry, sizeof(entry), toc) == sizeof(entry), "Truncated archive");
+			entry.offset = target.offset, entry.size = entry.size_decompressed = target.size;
+			CHECK(fp.write_at(&entry, sizeof(entry), toc) == sizeof(entry), "Failed to write output file");
+			return in_place;
+		}
+
+		// Applies one burst of changes. See watch()
+		// Returns false if they can't be applied yet, in which case they're to be retried along with the next burst.
+		bool apply(std::set<std::string> const& changed) {
+			using namespace std::filesystem;
+			trace::scope _("patch");
+			auto begin = std::chrono::steady_clock::now();
+			std::set<std::string> modified;
+			size_t added = 0, removed = 0;
+			for (auto& name : changed) {
+				bool present = is_regular_file(directory / name);
+				if (slots.contains(name)) present ? (void)modified.insert(name) : (void)removed++;
+				else if (present && valid_name(name)) added++;
+			}
+			bool structural = added || removed;
+			if (!modified.size() && !structural) return true;
+			std::map<std::string, u8vec> data;
+			for (auto& name : modified) data[name] = stored(name);
+			// ITOC offsets are implied by the sizes. Entries can only be patched in place if their aligned size stays the same,
+			// save for the last one, and if they stay in the same ITOC table.
+			if (type == format::CPK && !structural) {
+				const slot* last = nullptr;
+				for (auto& [_, slot] : slots) if (!last || slot.offset > last->offset) last = &slot;
+				for (auto& [name, stored] : data) {
+					auto& slot = slots[name];
+					if (&slot != last && alignUp(stored.size(), package::ITOC::Align) != alignUp(slot.size, package::ITOC::Align)) structural = true;
+					// Moving between DataL and DataH resizes the ITOC
+					if (package::ITOC::in_data_l(file_size(directory / name)) != package::ITOC::in_data_l(slot.size_decompressed)) structural = true;
+				}
+			}
+			size_t appended = 0;
+			if (structural) {
+				if (type == format::MPK) {
+					// Contiguous IDs are required. Renumbering is left to whoever is editing the directory.
+					std::vector<uint32_t> ids;
+					for (auto& file : directory_iterator(directory))
+						if (file.is_regular_file() && valid_name(file.path().filename().string())) ids.push_back(id_of(file.path().filename().string()));
+					std::sort(ids.begin(), ids.end());
+					for (size_t i = 0; i < ids.size(); i++)
+						if (ids[i] != i) {
+							fprintf(stderr, "watch: entry IDs aren't contiguous, waiting for more changes\n");
+							return false;
+						}
+				}
+				rebuild(modified);
+			}
+			else {
+				io::file fp(output, true, false);
+				CHECK(fp, "Failed to open output file: " + output.string());
+				uint64_t end = 0;
+				if (type == format::MPK) {
+					for (auto& [name, stored] : data) appended += !patch_mpk(fp, name, stored);
+				}
+				else {
+					uint64_t ContentOffset = UINT64_MAX;
+					for (auto& [_, slot] : slots) ContentOffset = std::min(ContentOffset, slot.offset);
+					for (auto& [name, stored] : data) {
+						auto& slot = slots[name];
+						CHECK(fp.write_at(stored.data(), stored.size(), slot.offset) == stored.size(), "Failed to write output file");
+						slot.size = stored.size(), slot.size_decompressed = file_size(directory / name);
+					}
+					std::vector<slot> sorted;
+					for (auto& [_, slot] : slots) sorted.push_back(slot);
+					std::sort(sorted.begin(), sorted.end(), PRED(lhs.id < rhs.id));
+					std::vector<cpk::utf::itoc_data_h> dataH;
+					for (auto& slot : sorted) dataH.push_back({ (uint16_t)slot.id, (uint32_t)slot.size, (uint32_t)slot.size_decompressed });
+					cpk::utf::table_header itocHdr = package::ITOC::write_itoc(fp, dataH);
+					package::ITOC::write_header(fp, ContentOffset, alignUp(sorted.back().offset + sorted.back().size, package::ITOC::Align), itocHdr.length);
+				}
+				// Drops whatever a shrunk last entry left behind
+				for (auto& [_, slot] : slots) end = std::max(end, slot.offset + slot.size);
+				fp.close();
+				if (end < file_size(output)) resize_file(output, end);
+			}
+			double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+			if (structural) fprintf(stderr, "watch: %zu changed, %zu added, %zu removed, rebuilt (%.1f ms)\n", modified.size(), added, removed, ms);
+			else fprintf(stderr, "watch: %zu changed, %zu patched in place, %zu appended (%.1f ms)\n", modified.size(), modified.size() - appended, appended, ms);
+			return true;
+		}
+	};
+
+	// Keeps `output`, packed from `directory` beforehand, in sync with the directory's contents until interrupted.
+	// Bursts of changes are collected until the directory stays quiet for `debounce_ms`, then applied at once:
+	// - Modified files are patched into the archive where they still fit, or appended (MPK), and the TOC is rewritten.
+	// - Otherwise (added or removed files, CPK entries changing size) the archive is rebuilt, with unchanged entries
+	//   copied over as stored (see io::append_extent).
+	// NOTE: Linux only (inotify)
+	inline void watch(std::filesystem::path const& directory, std::filesystem::path const& output, format type, bool compress, int debounce_ms = 250) {
+#ifdef __linux__
+		watcher state(directory, output, type, compress);
+		int fd = inotify_init1(IN_CLOEXEC);
+		CHECK(fd >= 0, "Failed to initialize inotify");
+		CHECK(inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_DELETE_SELF) >= 0, "Failed to watch " + directory.string());
+		fprintf(stderr, "watch: watching %s for changes to %s\n", directory.string().c_str(), output.filename().string().c_str());
+		alignas(inotify_event) char buffer[64 * 1024];
+		std::set<std::string> changed;
+		bool pending = false; // Changes that couldn't be applied yet wait for the next event
+		while (true) {
+			pollfd pfd{ fd, POLLIN, 0 };
+			int ready = poll(&pfd, 1, changed.size() && !pending ? debounce_ms : -1);
+			if (ready < 0 && errno == EINTR) continue;
+			CHECK(ready >= 0, "Failed to poll inotify");
+			if (!ready) {
+				if (state.apply(changed)) changed.clear();
+				else pending = true;
+				continue;
+			}
+			ssize_t n = read(fd, buffer, sizeof(buffer));
+			CHECK(n > 0, "Failed to read inotify events");
+			for (char* ptr = buffer; ptr < buffer + n;) {
+				auto event = (inotify_event*)ptr;
+				CHECK(!(event->mask & (IN_DELETE_SELF | IN_IGNORED)), "Watched directory is gone: " + directory.string());
+				if (event->len) changed.insert(event->name), pending = false;
+				ptr += sizeof(inotify_event) + event->len;
+			}
+		}
+#else
+		CHECK(false, "--watch is only supported on Linux");
+#endif
+	}
+}
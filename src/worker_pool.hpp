@@ -0,0 +1,68 @@
+#pragma once
+#include "pch.hpp"
+#include "trace.hpp"
+// Fixed size FIFO thread pool. One instance is meant to be shared by every
+// archive processed in a single invocation.
+struct worker_pool {
+	typedef std::function<void()> task;
+private:
+	std::vector<std::thread> workers;
+	std::deque<task> tasks;
+	std::mutex lock;
+	std::condition_variable task_ready, all_done;
+	size_t busy{ 0 };
+	bool stopping{ false };
+	static inline thread_local bool is_worker = false;
+
+	void work() {
+		trace::set_thread_name("worker");
+		is_worker = true;
+		while (true) {
+			task job;
+			{
+				std::unique_lock guard(lock);
+				task_ready.wait(guard, [&] { return stopping || !tasks.empty(); });
+				if (tasks.empty()) return;
+				job = std::move(tasks.front()); tasks.pop_front();
+				busy++;
+			}
+			job();
+			{
+				std::scoped_lock guard(lock);
+				busy--;
+				if (tasks.empty() && !busy) all_done.notify_all();
+			}
+		}
+	}
+public:
+	static size_t default_concurrency() { return std::max(1u, std::thread::hardware_concurrency()); }
+	// Whether the calling thread belongs to a pool, i.e. the cores are already being shared out
+	static bool on_worker() { return is_worker; }
+
+	worker_pool(size_t threads = default_concurrency()) {
+		threads = std::max<size_t>(threads, 1);
+		for (size_t i = 0; i < threads; i++) workers.emplace_back(&worker_pool::work, this);
+	}
+	worker_pool(worker_pool const&) = delete;
+	~worker_pool() {
+		{
+			std::scoped_lock guard(lock);
+			stopping = true;
+		}
+		task_ready.notify_all();
+		for (auto& worker : workers) worker.join();
+	}
+	size_t size() const { return workers.size(); }
+	void submit(task&& job) {
+		{
+			std::scoped_lock guard(lock);
+			tasks.push_back(std::move(job));
+		}
+		task_ready.notify_one();
+	}
+	// Blocks until every submitted task has finished
+	void wait() {
+		std::unique_lock guard(lock);
+		all_done.wait(guard, [&] { return tasks.empty() && !busy; });
+	}
+};